@@ -0,0 +1,133 @@
+/* Prueba del suavizado bilateral:
+
+        -Compara el resultado de la rejilla bilateral de ImageProcess con un
+        filtro bilateral exacto (fuerza bruta, radio de 2 sigma) sobre las
+        imagenes PGM incluidas en resources.
+
+        -Falla si el PSNR de algun caso queda por debajo de su limite.
+
+        -Aplica todas las operaciones sobre rectangulos sin base o sin altura,
+        que deben terminar sin error.
+
+    Uso:
+        $./bilateral_test lena_ascii.pgm barbara_ascii.pgm
+    (ctest la ejecuta con las imagenes de resources)
+*/
+
+#include "ImageProcess.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+/*sigmas of a case and the lowest PSNR accepted against the exact filter*/
+struct bilateralCase{
+    double sigmaS, sigmaR;
+    double minPSNR;
+};
+
+//floors sit at least 3 dB under the PSNR measured on the shipped images
+const bilateralCase cases[] = {
+    {4, 20, 42.0},
+    {8, 30, 40.0},
+    {16, 50, 34.0},
+    {3, 10, 47.0}
+};
+
+/*exact bilateral filter, pixels outside the image are left out of the average*/
+void bilateralReference(const unsigned char *gray, int w, int h, double sigmaS, double sigmaR,
+                        unsigned char *out){
+    int radius = (int)ceil(2*sigmaS);
+    int side = 2*radius + 1;
+    std::vector<double> spatial((size_t)side*side);
+    for(int dy = -radius; dy <= radius; dy++)
+        for(int dx = -radius; dx <= radius; dx++)
+            spatial[(dy+radius)*side + dx+radius] = exp(-(dx*dx + dy*dy)/(2*sigmaS*sigmaS));
+    double range[256];
+    for(int d = 0; d < 256; d++)
+        range[d] = exp(-d*d/(2*sigmaR*sigmaR));
+
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++){
+            int center = gray[(size_t)y*w + x];
+            double value = 0, weight = 0;
+            for(int dy = -radius; dy <= radius; dy++){
+                if(y+dy < 0 || y+dy >= h)
+                    continue;
+                for(int dx = -radius; dx <= radius; dx++){
+                    if(x+dx < 0 || x+dx >= w)
+                        continue;
+                    int v = gray[(size_t)(y+dy)*w + x+dx];
+                    double k = spatial[(dy+radius)*side + dx+radius] * range[abs(v - center)];
+                    value += k*v;
+                    weight += k;
+                }
+            }
+            out[(size_t)y*w + x] = (unsigned char)(value/weight + 0.5);
+        }
+    }
+}
+
+double psnr(const unsigned char *a, const unsigned char *b, size_t size){
+    double error = 0;
+    for(size_t i = 0; i < size; i++)
+        error += (double)(a[i] - b[i])*(a[i] - b[i]);
+    if(error == 0)
+        return INFINITY;
+    return 10*log10(255.0*255.0*size/error);
+}
+
+/*every operation over rectangles with no width or no height (the patch stays empty)*/
+void emptyRectangles(){
+    std::vector<unsigned char> gray(64*64, 128);
+    grayView image = {gray.data(), 64, 64, 64, 1};
+    const int sizes[2][2] = {{10, 0}, {0, 10}};
+    for(int op = 0; op < OP_COUNT; op++){
+        if(op == OP_RESIZE)
+            continue;
+        for(int s = 0; s < 2; s++){
+            ImageProcess img_op(image, op, 10, 10, sizes[s][0], sizes[s][1], 3, 3);
+            img_op.process();
+        }
+    }
+    printf("rectangulos vacios: ok\n");
+}
+
+int main(int argc, char **argv){
+    if(argc < 2){
+        printf("Uso: %s imagen.pgm [imagen.pgm ...]\n", argv[0]);
+        return 2;
+    }
+
+    emptyRectangles();
+
+    int failed = 0;
+    for(int i = 1; i < argc; i++){
+        pgmReader reader;
+        if(!reader.open(argv[i])){
+            printf("%s: no se pudo abrir\n", argv[i]);
+            failed++;
+            continue;
+        }
+        int w = reader.width, h = reader.height;
+        std::vector<unsigned char> gray((size_t)w*h), exact((size_t)w*h);
+        if(!reader.readRows(gray.data(), h)){
+            printf("%s: no se pudo leer\n", argv[i]);
+            failed++;
+            continue;
+        }
+        grayView image = {gray.data(), w, h, w, 1};
+
+        for(const bilateralCase &test : cases){
+            ImageProcess img_op(image, OP_BILATERAL, 0, 0, w, h, test.sigmaS, test.sigmaR);
+            img_op.process();
+            bilateralReference(gray.data(), w, h, test.sigmaS, test.sigmaR, exact.data());
+            double value = psnr(img_op.getPatchData(1), exact.data(), (size_t)w*h);
+            bool pass = value >= test.minPSNR;
+            printf("%s (%g, %g): %.1f dB (minimo %.1f) %s\n", argv[i], test.sigmaS, test.sigmaR,
+                    value, test.minPSNR, pass ? "ok" : "FALLA");
+            if(!pass)
+                failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
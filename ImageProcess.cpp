@@ -0,0 +1,1336 @@
+#include "ImageProcess.h"
+#include <cmath>
+#include <cctype>
+
+bufferPool patchPool;   //pool shared by every patch of the program
+workerPool workers;     //threads shared by every parallel operation
+resultCache results;    //results shared by every operation of the program
+
+/*64 bit hash of a buffer, eight bytes per step with a final mix of the tail*/
+uint64_t patchHash(const unsigned char *data, size_t size, uint64_t seed){
+    const uint64_t m = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = seed ^ (size*m);
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * m;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * m;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*copy the gray value of an image area into a buffer (all channels hold the same value)*/
+void getGrayRect(grayView image, int x, int y, int w, int h, unsigned char *gray){
+    for(int i = 0; i < h; i++){
+        const unsigned char *row = image.data + image.channels*((size_t)(y+i)*image.stride + x);
+        if(image.channels == 1){
+            memcpy(gray + (size_t)i*w, row, w);
+            continue;
+        }
+        for(int j = 0; j < w; j++){
+            gray[(size_t)i*w + j] = row[image.channels*j];
+        }
+    }
+}
+
+/*write a gray buffer over an image area in place (every channel gets the same value)*/
+void setGrayRect(grayView image, int x, int y, int w, int h, const unsigned char *gray){
+    for(int i = 0; i < h; i++){
+        unsigned char *row = image.data + image.channels*((size_t)(y+i)*image.stride + x);
+        if(image.channels == 1){
+            memcpy(row, gray + (size_t)i*w, w);
+            continue;
+        }
+        for(int j = 0; j < w; j++){
+            for(int c = 0; c < image.channels; c++)
+                row[image.channels*j + c] = gray[(size_t)i*w + j];
+        }
+    }
+}
+
+/*copy a patch row into a scratch row padded by replicating its border pixels*/
+void padRow(const unsigned char *row, int w, int pad, unsigned char *padded){
+    memcpy(padded + pad, row, w);
+    for(int j = 0; j < pad; j++){
+        padded[j] = row[0];
+        padded[pad + w + j] = row[w-1];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////Filtering Methods
+
+/*pointer to member functions using the order of the operation identifiers*/
+typedef void(ImageProcess::*Functionsptr)();
+
+const Functionsptr opArr[OP_COUNT] = {&ImageProcess::sobel_filter,  //array of pointers to functions
+                                    &ImageProcess::negative,
+                                    &ImageProcess::gauss_filter,
+                                    &ImageProcess::constrast,
+                                    &ImageProcess::canny_filter,
+                                    &ImageProcess::erosion,
+                                    &ImageProcess::dilation,
+                                    &ImageProcess::opening,
+                                    &ImageProcess::closing,
+                                    &ImageProcess::top_hat,
+                                    &ImageProcess::resize,
+                                    &ImageProcess::clahe,
+                                    &ImageProcess::bilateral};
+
+/*write the filtered (patch_mode 1) or pre-filtered (patch_mode 0) patch over the image in place*/
+void ImageProcess::setPatchImage(grayView image, int patch_mode){
+    if(empty)
+        return;
+
+    if(mask)
+        mask->scatter(image,patch_mode ? patch.data() : old_patch.data());
+    else if(patch_mode)
+        setGrayRect(image,x,y,rw,rh,patch.data());
+    else
+        setGrayRect(image,x,y,w,h,old_patch.data());
+}
+
+/*fill the filtered patch running the operation selected by op_ID, or take it from the result cache*/
+void ImageProcess::process(){
+    if(empty || op_ID < 0 || op_ID >= OP_COUNT)
+        return;
+
+    //key: input pixels, size, operation and parameters
+    uint64_t key = patchHash(old_patch.data(), old_patch.size(), (uint64_t)op_ID << 48 ^ (uint64_t)w << 24 ^ h);
+    uint64_t bits[2];
+    memcpy(bits, param, sizeof(bits));
+    key = patchHash((const unsigned char*)bits, sizeof(bits), key);
+    if(results.find(key, op_ID, w, h, param, old_patch, patch))
+        return;
+
+    filter();
+    results.insert(key, op_ID, w, h, param, old_patch, patch);
+}
+
+/*run the operation over the whole patch without looking at the result cache*/
+void ImageProcess::filter(){
+    patch = patchBuffer((size_t)rw*rh);
+    (this->*opArr[op_ID])();
+}
+
+/*fill the filtered pixels of a selection. Pointwise operations run over the selected pixels alone,
+  the others filter every block holding part of the selection with a halo read from the image, so
+  the cost follows the selected area instead of its bounding box. Blocks grow with the halo to keep
+  it a small part of each block, and they skip the result cache (they are never asked for again)*/
+void ImageProcess::process(grayView image){
+    if(!mask){
+        process();
+        return;
+    }
+    if(empty || op_ID < 0 || op_ID >= OP_COUNT || op_ID == OP_RESIZE)
+        return;
+
+    int halo = haloSize(op_ID, param);
+    if(halo == 0){
+        //selected pixels seen as a single row
+        ImageProcess row(op_ID, 0, 0, (int)old_patch.size(), 1, param[0], param[1], patchBuffer(), old_patch);
+        row.filter();
+        patch = row.patch;
+        return;
+    }
+
+    //operations depending on the whole area take the bounding box as a single block, as do
+    //selections spanning only a few blocks
+    int tile = std::max(MASKTILE, 4*halo);
+    if(halo < 0)
+        halo = 0;
+    if(halo == 0 || 2*tile >= std::max(w, h))
+        tile = std::max(w, h);
+    int tilesX = (w + tile - 1) / tile;
+    int tilesY = (h + tile - 1) / tile;
+
+    patch = patchBuffer(old_patch.size());
+    unsigned char *p_filter = patch.data();
+    const std::vector<spanMask::span> &spans = mask->getSpans();
+    std::vector<ImageProcess> blocks(tilesX);
+    size_t first = 0;
+    for(int ty = 0; ty < tilesY; ty++){
+        int y0 = y + ty*tile;
+        int y1 = std::min(y + h, y0 + tile);
+        size_t last = first;
+        while(last < spans.size() && spans[last].y < y1)
+            last++;
+        if(first == last)
+            continue;
+
+        //filter the blocks of this row touched by a span
+        std::vector<char> used(tilesX, 0);
+        for(size_t i = first; i < last; i++)
+            for(int tx = (spans[i].x - x) / tile; tx <= (spans[i].x + spans[i].length - 1 - x) / tile; tx++)
+                used[tx] = 1;
+        for(int tx = 0; tx < tilesX; tx++){
+            if(!used[tx]){
+                blocks[tx] = ImageProcess();
+                continue;
+            }
+            int bx0 = std::max(0, x + tx*tile - halo);
+            int by0 = std::max(0, y0 - halo);
+            int bx1 = std::min(image.width, std::min(x + w, x + (tx+1)*tile) + halo);
+            int by1 = std::min(image.height, y1 + halo);
+            blocks[tx] = ImageProcess(image, op_ID, bx0, by0, bx1 - bx0, by1 - by0, param[0], param[1]);
+            blocks[tx].filter();
+        }
+
+        //copy the selected pixels in span order, a span may cross several blocks
+        for(size_t i = first; i < last; i++){
+            int px = spans[i].x;
+            int end = spans[i].x + spans[i].length;
+            while(px < end){
+                ImageProcess &block = blocks[(px - x) / tile];
+                int stop = std::min(end, x + ((px - x) / tile + 1)*tile);
+                memcpy(p_filter, block.patch.data() + (size_t)(spans[i].y - block.y)*block.w + (px - block.x), stop - px);
+                p_filter += stop - px;
+                px = stop;
+            }
+        }
+        first = last;
+    }
+}
+
+/*Apply gaussian filter for smoother image*/
+void ImageProcess::gauss_filter(){
+    //Gauss Kernel 5x5 window
+    int kernel[5][5] = {{1,4,7,4,1},
+                        {4,16,26,16,4},
+                        {7,26,41,26,7},
+                        {4,16,26,16,4},
+                        {1,4,7,4,1}};
+    int f_rows = 5,f_cols = 5;
+    //filter matrix center
+    int center_i = f_rows/2;
+    int center_j = f_cols/2;
+
+    //division coefficient
+    int div_c = 0;
+
+    //calculate division coeficient
+    for(int i= 0; i < f_rows*f_cols; i++){
+        div_c += *(kernel[0] + i);
+    }
+
+    //scratch rows for the filter window and the row accumulator
+    scratchArena arena(rowWindow::bytes(w,center_j,f_rows) + w*sizeof(int) + 16);
+    rowWindow window(arena,old_patch.data(),w,h,center_j,f_rows);
+    int *acc = arena.alloc<int>(w);
+
+    unsigned char *p_filter = patch.data();
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++)
+            acc[x] = 0;
+
+        //accumulate every kernel coefficient over the whole row
+        for(int i = 0; i < f_rows; i++){
+            const unsigned char *p_original = window.row(y-center_i+i);
+            for(int j = 0; j < f_cols; j++){
+                int k = kernel[i][j];
+                for(int x = 0; x < w; x++)
+                    acc[x] += p_original[x+j] * k;
+            }
+        }
+
+        for(int x = 0; x < w; x++)
+            p_filter[x] = acc[x] / div_c;
+        p_filter += w;
+    }
+}
+
+/*Apply Sobel filter for border detection */
+void ImageProcess::sobel_filter(){
+    //Sobel kernel
+    int sx[3][3] = { {-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1} };
+    int sy[3][3] = { {1, 2, 1}, {0, 0, 0}, {-1, -2, -1} };
+    //kernel center
+    int center_i = 1;
+    int center_j = 1;
+
+    //scratch rows for the filter window and both gradient accumulators
+    scratchArena arena(rowWindow::bytes(w,center_j,3) + 2*w*sizeof(int) + 32);
+    rowWindow window(arena,old_patch.data(),w,h,center_j,3);
+    int *aux_gx = arena.alloc<int>(w);
+    int *aux_gy = arena.alloc<int>(w);
+
+    unsigned char *p_filter = patch.data();
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++)
+            aux_gx[x] = aux_gy[x] = 0;
+
+        for(int i = 0; i < 3; i++){
+            const unsigned char *p_original = window.row(y-center_i+i);
+            for(int j = 0; j < 3; j++){
+                int kx = sx[i][j], ky = sy[i][j];
+                for(int x = 0; x < w; x++){
+                    aux_gx[x] += p_original[x+j] * kx;
+                    aux_gy[x] += p_original[x+j] * ky;
+                }
+            }
+        }
+
+        //8 bit limit (value clipping)
+        for(int x = 0; x < w; x++){
+            int res = (int)sqrt(aux_gx[x]*aux_gx[x] + aux_gy[x]*aux_gy[x]);
+            p_filter[x] = res > 255 ? 255 : res;
+        }
+        p_filter += w;
+    }
+}
+
+/*Change constrast factor (alpha) and ilumination (beta) */
+void ImageProcess::constrast(){
+    double alpha = param[0];
+    int beta = (int)param[1];
+
+    //lookup table for every gray level
+    unsigned char lut[256];
+    for(int v = 0; v < 256; v++){
+        int value = (int)(v * alpha) + beta;
+        //8 bit limit (value clipping)
+        lut[v] = value > 255 ? 255 : (value < 0 ? 0 : value);
+    }
+
+    const unsigned char *p_original = old_patch.data();
+    unsigned char *p_filter = patch.data();
+    for(size_t i = 0; i < (size_t)w*h; i++)
+        p_filter[i] = lut[p_original[i]];
+}
+
+/*Change values to their difference from the max value (255) */
+void ImageProcess::negative(){
+    const unsigned char *p_original = old_patch.data();
+    unsigned char *p_filter = patch.data();
+    for(size_t i = 0; i < (size_t)w*h; i++)
+        p_filter[i] = 255 ^ p_original[i];
+}
+
+
+/*gradient, direction quantization and non-maximum suppression of rows [y0,y1) in one pass.
+  Pixels are labeled 2 (strong edge), 1 (weak edge) or 0*/
+void ImageProcess::canny_band(unsigned char *label, int y0, int y1, int low, int high){
+    //scratch: source window, three magnitude rows (zero padded) and their directions
+    scratchArena arena(rowWindow::bytes(w,1,3) + 3*(w+2)*sizeof(int) + 3*w + 128);
+    rowWindow window(arena,old_patch.data(),w,h,1,3);
+    int *mag[3];
+    unsigned char *dir[3];
+    for(int i = 0; i < 3; i++){
+        mag[i] = arena.alloc<int>(w+2);
+        dir[i] = arena.alloc<unsigned char>(w);
+    }
+
+    for(int r = y0-1; r <= y1; r++){
+        int *m = mag[(r+3) % 3];
+        unsigned char *d = dir[(r+3) % 3];
+        m[0] = m[w+1] = 0;
+
+        if(r < 0 || r >= h){
+            //rows outside the patch never hold edges
+            for(int x = 0; x < w; x++)
+                m[x+1] = 0;
+        }else{
+            const unsigned char *up = window.row(r-1);
+            const unsigned char *mid = window.row(r);
+            const unsigned char *down = window.row(r+1);
+            for(int x = 0; x < w; x++){
+                int gx = (up[x+2] + 2*mid[x+2] + down[x+2]) - (up[x] + 2*mid[x] + down[x]);
+                int gy = (down[x] + 2*down[x+1] + down[x+2]) - (up[x] + 2*up[x+1] + up[x+2]);
+                m[x+1] = (int)sqrtf((float)(gx*gx + gy*gy));
+
+                //sector of the gradient: 0 horizontal, 1 diagonal "\", 2 vertical, 3 diagonal "/"
+                int ax = gx < 0 ? -gx : gx;
+                int ay = gy < 0 ? -gy : gy;
+                if(ay*1000 <= ax*414)
+                    d[x] = 0;
+                else if(ay*414 >= ax*1000)
+                    d[x] = 2;
+                else
+                    d[x] = ((gx ^ gy) >= 0) ? 1 : 3;
+            }
+        }
+
+        //suppress non maximum pixels of the previous row once its neighbours are known
+        int y = r-1;
+        if(y < y0 || y >= y1)
+            continue;
+        const int *above = mag[(y+2) % 3] + 1;
+        const int *center = mag[(y+3) % 3] + 1;
+        const int *below = mag[(y+4) % 3] + 1;
+        const unsigned char *dc = dir[(y+3) % 3];
+        unsigned char *out = label + (size_t)y*w;
+        for(int x = 0; x < w; x++){
+            int value = center[x];
+            int a, b;
+            switch(dc[x]){
+                case 0:  a = center[x-1]; b = center[x+1]; break;
+                case 1:  a = above[x-1];  b = below[x+1];  break;
+                case 2:  a = above[x];    b = below[x];    break;
+                default: a = above[x+1];  b = below[x-1];  break;
+            }
+            if(value < low || value <= a || value < b)
+                out[x] = 0;
+            else
+                out[x] = value >= high ? 2 : 1;
+        }
+    }
+}
+
+/*Canny edge detector: fused gradient and suppression by bands, then hysteresis between thresholds*/
+void ImageProcess::canny_filter(){
+    if(w == 0 || h == 0)
+        return;
+    int low = (int)param[0];
+    int high = (int)param[1];
+    if(low > high)
+        std::swap(low,high);
+
+    //edge labels of the whole patch
+    patchBuffer labels((size_t)w*h);
+    unsigned char *label = labels.data();
+
+    //bands of rows processed in parallel
+    int bands = std::min(h, workers.size()*4);
+    int bandRows = (h + bands - 1) / bands;
+    bands = (h + bandRows - 1) / bandRows;
+    std::vector<std::vector<int>> queues(bands);
+
+    workers.run(bands, [&](int band){
+        int y0 = band*bandRows;
+        int y1 = std::min(h, y0 + bandRows);
+        canny_band(label,y0,y1,low,high);
+
+        //hysteresis inside the band: weak pixels connected to strong ones become strong
+        std::vector<int> &queue = queues[band];
+        for(int y = y0; y < y1; y++)
+            for(int x = 0; x < w; x++)
+                if(label[(size_t)y*w + x] == 2)
+                    queue.push_back(y*w + x);
+        for(size_t i = 0; i < queue.size(); i++){
+            int py = queue[i] / w, px = queue[i] % w;
+            for(int ny = std::max(py-1,y0); ny <= std::min(py+1,y1-1); ny++){
+                for(int nx = std::max(px-1,0); nx <= std::min(px+1,w-1); nx++){
+                    if(label[(size_t)ny*w + nx] == 1){
+                        label[(size_t)ny*w + nx] = 2;
+                        queue.push_back(ny*w + nx);
+                    }
+                }
+            }
+        }
+        queue.clear();
+    });
+
+    //connect edges crossing band limits with a single queue over the whole patch
+    std::vector<int> queue;
+    for(int band = 1; band < bands; band++){
+        int y = band*bandRows;
+        for(int side = -1; side <= 0; side++){
+            for(int x = 0; x < w; x++){
+                int inner = (y+side)*w + x;
+                int other = side ? y : y-1;
+                if(label[inner] != 2)
+                    continue;
+                for(int nx = std::max(x-1,0); nx <= std::min(x+1,w-1); nx++){
+                    if(label[(size_t)other*w + nx] == 1){
+                        label[(size_t)other*w + nx] = 2;
+                        queue.push_back(other*w + nx);
+                    }
+                }
+            }
+        }
+    }
+    for(size_t i = 0; i < queue.size(); i++){
+        int py = queue[i] / w, px = queue[i] % w;
+        for(int ny = std::max(py-1,0); ny <= std::min(py+1,h-1); ny++){
+            for(int nx = std::max(px-1,0); nx <= std::min(px+1,w-1); nx++){
+                if(label[(size_t)ny*w + nx] == 1){
+                    label[(size_t)ny*w + nx] = 2;
+                    queue.push_back(ny*w + nx);
+                }
+            }
+        }
+    }
+
+    unsigned char *p_filter = patch.data();
+    for(size_t i = 0; i < (size_t)w*h; i++)
+        p_filter[i] = label[i] == 2 ? 255 : 0;
+}
+
+/*minimum (erosion) or maximum (dilation) of two gray values*/
+template<bool dilate> inline unsigned char morphPick(unsigned char a, unsigned char b){
+    return dilate ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+/*van Herk/Gil-Werman running min/max of length k along rows [y0,y1): prefix and suffix
+  extremes inside blocks of k pixels give any window with one comparison, whatever k is*/
+template<bool dilate> void vhgwRows(const unsigned char *src, unsigned char *dst, int w, int y0, int y1,
+                                    int k, int before){
+    unsigned char identity = dilate ? 0 : 255;
+    int n = ((w + k - 1 + k - 1) / k) * k;
+    scratchArena arena(3*(size_t)n + 64);
+    unsigned char *padded = arena.alloc<unsigned char>(n);
+    unsigned char *g = arena.alloc<unsigned char>(n);
+    unsigned char *hs = arena.alloc<unsigned char>(n);
+
+    //pixels outside the patch never win
+    memset(padded, identity, n);
+    for(int y = y0; y < y1; y++){
+        memcpy(padded + before, src + (size_t)y*w, w);
+        for(int b = 0; b < n; b += k){
+            g[b] = padded[b];
+            for(int i = b+1; i < b+k; i++)
+                g[i] = morphPick<dilate>(g[i-1], padded[i]);
+            hs[b+k-1] = padded[b+k-1];
+            for(int i = b+k-2; i >= b; i--)
+                hs[i] = morphPick<dilate>(hs[i+1], padded[i]);
+        }
+
+        unsigned char *out = dst + (size_t)y*w;
+        for(int x = 0; x < w; x++)
+            out[x] = morphPick<dilate>(hs[x], g[x+k-1]);
+    }
+}
+
+/*same running min/max of length k along columns [x0,x1), processed a whole row segment at a time*/
+template<bool dilate> void vhgwColumns(const unsigned char *src, unsigned char *dst, int w, int h, int x0, int x1,
+                                        int k, int before){
+    unsigned char identity = dilate ? 0 : 255;
+    int sw = x1 - x0;
+    int m = ((h + k - 1 + k - 1) / k) * k;
+    scratchArena arena(2*(size_t)m*(sw + 16) + sw + 64);
+    unsigned char *g = arena.alloc<unsigned char>((size_t)m*sw);
+    unsigned char *hs = arena.alloc<unsigned char>((size_t)m*sw);
+    unsigned char *outside = arena.alloc<unsigned char>(sw);
+    memset(outside, identity, sw);
+
+    for(int b = 0; b < m; b += k){
+        for(int i = b; i < b+k; i++){
+            int r = i - before;
+            const unsigned char *row = (r >= 0 && r < h) ? src + (size_t)r*w + x0 : outside;
+            unsigned char *gi = g + (size_t)i*sw;
+            if(i == b){
+                memcpy(gi, row, sw);
+            }else{
+                const unsigned char *prev = gi - sw;
+                for(int x = 0; x < sw; x++)
+                    gi[x] = morphPick<dilate>(prev[x], row[x]);
+            }
+        }
+        for(int i = b+k-1; i >= b; i--){
+            int r = i - before;
+            const unsigned char *row = (r >= 0 && r < h) ? src + (size_t)r*w + x0 : outside;
+            unsigned char *hi = hs + (size_t)i*sw;
+            if(i == b+k-1){
+                memcpy(hi, row, sw);
+            }else{
+                const unsigned char *next = hi + sw;
+                for(int x = 0; x < sw; x++)
+                    hi[x] = morphPick<dilate>(next[x], row[x]);
+            }
+        }
+    }
+
+    for(int y = 0; y < h; y++){
+        const unsigned char *a = hs + (size_t)y*sw;
+        const unsigned char *b = g + (size_t)(y+k-1)*sw;
+        unsigned char *out = dst + (size_t)y*w + x0;
+        for(int x = 0; x < sw; x++)
+            out[x] = morphPick<dilate>(a[x], b[x]);
+    }
+}
+
+/*erode or dilate a w x h buffer with a rectangular structuring element (param: width, height)*/
+void ImageProcess::morphology(const unsigned char *src, unsigned char *dst, bool dilate){
+    if(w == 0 || h == 0)
+        return;
+    int kw = std::max(1, (int)param[0]);
+    int kh = std::max(1, (int)param[1]);
+    //dilation uses the reflected element so opening and closing are exact for even sizes
+    int beforeX = dilate ? kw-1-kw/2 : kw/2;
+    int beforeY = dilate ? kh-1-kh/2 : kh/2;
+
+    patchBuffer rows((size_t)w*h);
+    unsigned char *tmp = rows.data();
+
+    //horizontal pass by bands of rows, vertical pass by strips of columns
+    int bands = std::min(h, workers.size()*4);
+    int bandRows = (h + bands - 1) / bands;
+    workers.run(bands, [&](int band){
+        int y0 = band*bandRows;
+        int y1 = std::min(h, y0 + bandRows);
+        if(y0 >= y1)
+            return;
+        if(dilate)
+            vhgwRows<true>(src, tmp, w, y0, y1, kw, beforeX);
+        else
+            vhgwRows<false>(src, tmp, w, y0, y1, kw, beforeX);
+    });
+
+    int strips = std::max(1, std::min(workers.size()*2, w / 64));
+    int stripCols = (w + strips - 1) / strips;
+    workers.run(strips, [&](int strip){
+        int x0 = strip*stripCols;
+        int x1 = std::min(w, x0 + stripCols);
+        if(x0 >= x1)
+            return;
+        if(dilate)
+            vhgwColumns<true>(tmp, dst, w, h, x0, x1, kh, beforeY);
+        else
+            vhgwColumns<false>(tmp, dst, w, h, x0, x1, kh, beforeY);
+    });
+}
+
+/*Minimum under the structuring element (shrinks bright regions)*/
+void ImageProcess::erosion(){
+    morphology(old_patch.data(), patch.data(), false);
+}
+
+/*Maximum under the structuring element (grows bright regions)*/
+void ImageProcess::dilation(){
+    morphology(old_patch.data(), patch.data(), true);
+}
+
+/*Erosion followed by dilation (removes small bright details)*/
+void ImageProcess::opening(){
+    patchBuffer eroded((size_t)w*h);
+    morphology(old_patch.data(), eroded.data(), false);
+    morphology(eroded.data(), patch.data(), true);
+}
+
+/*Dilation followed by erosion (fills small dark details)*/
+void ImageProcess::closing(){
+    patchBuffer dilated((size_t)w*h);
+    morphology(old_patch.data(), dilated.data(), true);
+    morphology(dilated.data(), patch.data(), false);
+}
+
+/*Difference between the patch and its opening (keeps small bright details)*/
+void ImageProcess::top_hat(){
+    patchBuffer eroded((size_t)w*h);
+    morphology(old_patch.data(), eroded.data(), false);
+    morphology(eroded.data(), patch.data(), true);
+
+    const unsigned char *p_original = old_patch.data();
+    unsigned char *p_filter = patch.data();
+    for(size_t i = 0; i < (size_t)w*h; i++)
+        p_filter[i] = p_original[i] - p_filter[i];
+}
+
+/*Scale the whole image (param: scale percent, interpolation 1 bilinear, 2 bicubic, 3 Lanczos)*/
+void ImageProcess::resize(){
+    grayView src = {old_patch.data(), w, h, w, 1};
+    grayView dst = {patch.data(), rw, rh, rw, 1};
+    resampleGray(src, dst, (int)param[1]);
+}
+
+/*tiles whose centers surround position pos and the weight of the second one (borders use one tile)*/
+static void tileBlend(const int *bounds, int tiles, int pos, int &first, int &second, float &weight){
+    first = second = 0;
+    weight = 0.0f;
+    for(int t = 0; t < tiles; t++){
+        float center = 0.5f*(bounds[t] + bounds[t+1] - 1);
+        if(pos < center)
+            break;
+        first = second = t;
+        if(t + 1 < tiles){
+            float next = 0.5f*(bounds[t+1] + bounds[t+2] - 1);
+            if(pos < next){
+                second = t + 1;
+                weight = (pos - center) / (next - center);
+                break;
+            }
+        }
+    }
+}
+
+/*Contrast limited adaptive histogram equalization (param: tiles per side, clip limit).
+  Every tile gets its own equalization table from a histogram clipped at clip limit times
+  the mean bin count, pixels blend the tables of the four nearest tile centers*/
+void ImageProcess::clahe(){
+    if(w == 0 || h == 0)
+        return;
+    int tilesX = std::max(1, std::min(w, (int)param[0]));
+    int tilesY = std::max(1, std::min(h, (int)param[0]));
+    double clipLimit = param[1];
+
+    //tile bounds and centers
+    std::vector<int> tileX(tilesX + 1), tileY(tilesY + 1);
+    for(int t = 0; t <= tilesX; t++)
+        tileX[t] = (int)((long)t*w / tilesX);
+    for(int t = 0; t <= tilesY; t++)
+        tileY[t] = (int)((long)t*h / tilesY);
+
+    //equalization table of every tile, tiles computed in parallel
+    patchBuffer tables((size_t)tilesX*tilesY*256);
+    unsigned char *lut = tables.data();
+    const unsigned char *p_original = old_patch.data();
+    workers.run(tilesX*tilesY, [&](int tile){
+        int tx = tile % tilesX, ty = tile / tilesX;
+        int x0 = tileX[tx], x1 = tileX[tx+1];
+        int y0 = tileY[ty], y1 = tileY[ty+1];
+        int area = (x1 - x0)*(y1 - y0);
+
+        int hist[256] = {0};
+        for(int y = y0; y < y1; y++){
+            const unsigned char *row = p_original + (size_t)y*w;
+            for(int x = x0; x < x1; x++)
+                hist[row[x]]++;
+        }
+
+        //clip bins and spread the excess over the whole histogram
+        if(clipLimit > 0){
+            int clip = std::max(1, (int)(clipLimit*area/256));
+            int excess = 0;
+            for(int v = 0; v < 256; v++){
+                if(hist[v] > clip){
+                    excess += hist[v] - clip;
+                    hist[v] = clip;
+                }
+            }
+            int share = excess / 256;
+            int rest = excess - share*256;
+            for(int v = 0; v < 256; v++)
+                hist[v] += share;
+            if(rest > 0){
+                int step = std::max(1, 256 / rest);
+                for(int v = 0; v < 256 && rest > 0; v += step, rest--)
+                    hist[v]++;
+            }
+        }
+
+        unsigned char *table = lut + (size_t)tile*256;
+        float scale = 255.0f / area;
+        int cdf = 0;
+        for(int v = 0; v < 256; v++){
+            cdf += hist[v];
+            int value = (int)(cdf*scale + 0.5f);
+            table[v] = value > 255 ? 255 : value;
+        }
+    });
+
+    //nearest tile centers and blend weight of every column (same for every row)
+    std::vector<int> left(w), right(w);
+    std::vector<float> fx(w);
+    for(int x = 0; x < w; x++)
+        tileBlend(tileX.data(), tilesX, x, left[x], right[x], fx[x]);
+
+    //bands of rows: tables of the two nearest tile rows are blended once per row in whole
+    //contiguous loops, then every pixel blends two entries of that row table
+    unsigned char *p_filter = patch.data();
+    int bands = std::min(h, workers.size()*4);
+    int bandRows = (h + bands - 1) / bands;
+    workers.run(bands, [&](int band){
+        int y0 = band*bandRows;
+        int y1 = std::min(h, y0 + bandRows);
+        if(y0 >= y1)
+            return;
+        scratchArena arena((size_t)tilesX*256*sizeof(float) + 64);
+        float *rowTable = arena.alloc<float>((size_t)tilesX*256);
+
+        for(int y = y0; y < y1; y++){
+            //nearest tile rows above and below
+            int top, bottom;
+            float fy;
+            tileBlend(tileY.data(), tilesY, y, top, bottom, fy);
+
+            const unsigned char *a = lut + (size_t)top*tilesX*256;
+            const unsigned char *b = lut + (size_t)bottom*tilesX*256;
+            for(int i = 0; i < tilesX*256; i++)
+                rowTable[i] = a[i] + fy*(b[i] - a[i]);
+
+            const unsigned char *row = p_original + (size_t)y*w;
+            unsigned char *out = p_filter + (size_t)y*w;
+            for(int x = 0; x < w; x++){
+                float l = rowTable[left[x]*256 + row[x]];
+                float r = rowTable[right[x]*256 + row[x]];
+                out[x] = (unsigned char)(l + fx[x]*(r - l) + 0.5f);
+            }
+        }
+    });
+}
+
+/*Edge preserving smoothing (param: spatial sigma in pixels, range sigma in gray levels) on a bilateral
+  grid: pixels are accumulated in cells of one sigma along x, y and gray level, the grid is blurred
+  with a small gaussian and every pixel reads its smoothed value back by trilinear interpolation*/
+void ImageProcess::bilateral(){
+    if(w == 0 || h == 0)
+        return;
+    const int pad = 2;      //empty cells around the grid, the blur reaches two cells
+    double sigmaS = std::max(1.0, param[0]);
+    double sigmaR = std::max(1.0, param[1]);
+
+    //one cell per sigma, spatially coarser if the grid would get too large
+    double rateS = sigmaS, rateR = sigmaR;
+    int nx, ny, nz;
+    while(true){
+        nx = (int)((w-1)/rateS + 0.5) + 1 + 2*pad;
+        ny = (int)((h-1)/rateS + 0.5) + 1 + 2*pad;
+        nz = (int)(255/rateR + 0.5) + 1 + 2*pad;
+        if((size_t)nx*ny*nz <= BILATERALCELLS)
+            break;
+        rateS *= 1.25;
+    }
+
+    //spatial and range gaussians in cells (sigma of one cell unless the sampling got coarser)
+    float kernel[2][5];
+    double cellSigma[2] = {sigmaS/rateS, sigmaR/rateR};
+    for(int a = 0; a < 2; a++){
+        double sum = 0;
+        for(int k = -2; k <= 2; k++)
+            sum += exp(-k*k/(2*cellSigma[a]*cellSigma[a]));
+        for(int k = -2; k <= 2; k++)
+            kernel[a][k+2] = (float)(exp(-k*k/(2*cellSigma[a]*cellSigma[a])) / sum);
+    }
+
+    //two grids of (value sum, weight) pairs, cell (gx, gy, gz) at ((gy*nx + gx)*nz + gz)*2
+    size_t cells = (size_t)nx*ny*nz;
+    patchBuffer gridA(cells*2*sizeof(float)), gridB(cells*2*sizeof(float));
+    float *a = (float*)gridA.data();
+    float *b = (float*)gridB.data();
+    memset(a, 0, cells*2*sizeof(float));
+
+    //splat: every pixel goes to its nearest cell, grid rows are split between bands so no cell is shared
+    const unsigned char *p_original = old_patch.data();
+    std::vector<int> cellX(w), cellY(h);
+    int cellZ[256];
+    for(int x = 0; x < w; x++)
+        cellX[x] = (int)(x/rateS + 0.5) + pad;
+    for(int y = 0; y < h; y++)
+        cellY[y] = (int)(y/rateS + 0.5) + pad;
+    for(int v = 0; v < 256; v++)
+        cellZ[v] = (int)(v/rateR + 0.5) + pad;
+    int bands = std::min(ny, workers.size()*4);
+    int bandCells = (ny + bands - 1) / bands;
+    workers.run(bands, [&](int band){
+        int c0 = band*bandCells, c1 = c0 + bandCells;
+        for(int y = 0; y < h; y++){
+            if(cellY[y] < c0 || cellY[y] >= c1)
+                continue;
+            const unsigned char *row = p_original + (size_t)y*w;
+            float *gridRow = a + (size_t)cellY[y]*nx*nz*2;
+            for(int x = 0; x < w; x++){
+                float *cell = gridRow + ((size_t)cellX[x]*nz + cellZ[row[x]])*2;
+                cell[0] += row[x];
+                cell[1] += 1.0f;
+            }
+        }
+    });
+
+    //separable blur along gray level, x and y (a -> b -> a -> b), one grid row per band
+    int step[3] = {nx*nz*2, nz*2, 2};     //floats between neighbors along y, x and gray level
+    int size[3] = {ny, nx, nz};
+    int order[3] = {2, 1, 0};
+    float *src = a, *dst = b;
+    for(int pass = 0; pass < 3; pass++){
+        int axis = order[pass];
+        const float *k = kernel[axis == 2 ? 1 : 0];
+        workers.run(ny, [&](int gy){
+            for(int gx = 0; gx < nx; gx++){
+                for(int gz = 0; gz < nz; gz++){
+                    int coord[3] = {gy, gx, gz};
+                    size_t i = (size_t)gy*step[0] + (size_t)gx*step[1] + (size_t)gz*step[2];
+                    float value = 0, weight = 0;
+                    for(int t = -2; t <= 2; t++){
+                        int c = coord[axis] + t;
+                        if(c < 0 || c >= size[axis])
+                            continue;
+                        const float *cell = src + i + (long)t*step[axis];
+                        value += k[t+2]*cell[0];
+                        weight += k[t+2]*cell[1];
+                    }
+                    dst[i] = value;
+                    dst[i+1] = weight;
+                }
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    //slice: trilinear interpolation at the position of every pixel (offsets and fractions by column and gray level)
+    std::vector<size_t> offsetX(w);
+    std::vector<float> fractionX(w);
+    size_t offsetZ[256];
+    float fractionZ[256];
+    for(int x = 0; x < w; x++){
+        double gx = x/rateS + pad;
+        offsetX[x] = (size_t)gx*step[1];
+        fractionX[x] = (float)(gx - (int)gx);
+    }
+    for(int v = 0; v < 256; v++){
+        double gz = v/rateR + pad;
+        offsetZ[v] = (size_t)gz*step[2];
+        fractionZ[v] = (float)(gz - (int)gz);
+    }
+    unsigned char *p_filter = patch.data();
+    bands = std::min(h, workers.size()*4);
+    int bandRows = (h + bands - 1) / bands;
+    workers.run(bands, [&](int band){
+        int y0 = band*bandRows;
+        int y1 = std::min(h, y0 + bandRows);
+        for(int y = y0; y < y1; y++){
+            double gy = y/rateS + pad;
+            float fy = (float)(gy - (int)gy);
+            const float *gridRow = src + (size_t)gy*step[0];
+            const unsigned char *row = p_original + (size_t)y*w;
+            unsigned char *out = p_filter + (size_t)y*w;
+            for(int x = 0; x < w; x++){
+                float fx = fractionX[x], fz = fractionZ[row[x]];
+                const float *c000 = gridRow + offsetX[x] + offsetZ[row[x]];
+                const float *c010 = c000 + step[0];
+
+                //interpolate along gray level, then x, then y
+                float v00 = c000[0] + fz*(c000[step[2]] - c000[0]);
+                float w00 = c000[1] + fz*(c000[step[2]+1] - c000[1]);
+                float v10 = c000[step[1]] + fz*(c000[step[1]+step[2]] - c000[step[1]]);
+                float w10 = c000[step[1]+1] + fz*(c000[step[1]+step[2]+1] - c000[step[1]+1]);
+                float v01 = c010[0] + fz*(c010[step[2]] - c010[0]);
+                float w01 = c010[1] + fz*(c010[step[2]+1] - c010[1]);
+                float v11 = c010[step[1]] + fz*(c010[step[1]+step[2]] - c010[step[1]]);
+                float w11 = c010[step[1]+1] + fz*(c010[step[1]+step[2]+1] - c010[step[1]+1]);
+                float vt = v00 + fx*(v10 - v00), wt = w00 + fx*(w10 - w00);
+                float vb = v01 + fx*(v11 - v01), wb = w01 + fx*(w11 - w01);
+                float value = vt + fy*(vb - vt);
+                float weight = wt + fy*(wb - wt);
+                int result = weight > 1e-6f ? (int)(value/weight + 0.5f) : row[x];
+                out[x] = result > 255 ? 255 : (result < 0 ? 0 : result);
+            }
+        }
+    });
+}
+
+/////////////////////////////////////////////////////////////////////Resampling
+
+/*source window and weights of every destination pixel along one axis, all windows have the same
+  number of taps so the inner loops have a fixed length*/
+struct resampleAxis{
+    std::vector<int> start;         //first source pixel of each window
+    std::vector<float> weight;      //taps weights per destination pixel
+    int taps;
+};
+
+/*interpolation kernel evaluated at distance t from the sample*/
+static double resampleKernel(int method, double t){
+    t = fabs(t);
+    if(method == RESAMPLE_LANCZOS){
+        if(t < 1e-8)
+            return 1.0;
+        if(t >= 3.0)
+            return 0.0;
+        double a = M_PI*t;
+        return 3.0*sin(a)*sin(a/3.0) / (a*a);
+    }
+    if(method == RESAMPLE_BICUBIC){
+        //Keys cubic with a = -0.5
+        if(t < 1.0)
+            return (1.5*t - 2.5)*t*t + 1.0;
+        if(t < 2.0)
+            return ((-0.5*t + 2.5)*t - 4.0)*t + 2.0;
+        return 0.0;
+    }
+    return t < 1.0 ? 1.0 - t : 0.0;
+}
+
+/*weights mapping srcSize pixels to dstSize pixels (borders are replicated)*/
+static void resampleWeights(int srcSize, int dstSize, int method, resampleAxis &axis){
+    double scale = (double)srcSize / dstSize;
+    double support = method == RESAMPLE_LANCZOS ? 3.0 : (method == RESAMPLE_BICUBIC ? 2.0 : 1.0);
+    bool area = dstSize < srcSize || method == RESAMPLE_AREA;
+
+    //weights of every window before giving them the common tap count
+    std::vector<int> first(dstSize), last(dstSize);
+    std::vector<std::vector<double>> taps(dstSize);
+    axis.taps = 1;
+    for(int i = 0; i < dstSize; i++){
+        std::vector<double> &wi = taps[i];
+        if(area){
+            //fraction of every source pixel covered by the destination pixel
+            double lo = i*scale, hi = (i+1)*scale;
+            first[i] = std::min(srcSize-1, (int)lo);
+            last[i] = std::max(first[i], std::min(srcSize-1, (int)ceil(hi) - 1));
+            for(int j = first[i]; j <= last[i]; j++)
+                wi.push_back(std::max(0.0, std::min(hi, j+1.0) - std::max(lo, (double)j)));
+        }else{
+            double center = (i + 0.5)*scale - 0.5;
+            int j0 = (int)floor(center - support) + 1;
+            int j1 = (int)floor(center + support);
+            first[i] = std::max(0, std::min(srcSize-1, j0));
+            last[i] = std::max(0, std::min(srcSize-1, j1));
+            wi.assign(last[i] - first[i] + 1, 0.0);
+            for(int j = j0; j <= j1; j++){
+                int clamped = std::max(0, std::min(srcSize-1, j));
+                wi[clamped - first[i]] += resampleKernel(method, center - j);
+            }
+        }
+        axis.taps = std::max(axis.taps, last[i] - first[i] + 1);
+    }
+
+    //normalized weights placed inside windows of the same size
+    axis.start.assign(dstSize, 0);
+    axis.weight.assign((size_t)dstSize*axis.taps, 0.0f);
+    for(int i = 0; i < dstSize; i++){
+        double sum = 0;
+        for(size_t k = 0; k < taps[i].size(); k++)
+            sum += taps[i][k];
+        if(sum == 0)
+            sum = 1;
+        axis.start[i] = std::max(0, std::min(first[i], srcSize - axis.taps));
+        float *wi = &axis.weight[(size_t)i*axis.taps];
+        for(size_t k = 0; k < taps[i].size(); k++)
+            wi[first[i] - axis.start[i] + k] = (float)(taps[i][k] / sum);
+    }
+}
+
+/*separable resize of src into dst: rows are filtered horizontally into float rows, then every
+  output row is a weighted sum of whole float rows (a contiguous loop the compiler vectorizes).
+  Reduced axes average the covered area, enlarged axes use the interpolation given by method.
+  Only destination rows reading source rows in [srcTop, srcBottom) are written, dstRows receives them*/
+void resampleGray(grayView src, grayView dst, int method, int srcTop, int srcBottom, int *dstRows){
+    if(dstRows)
+        dstRows[0] = dstRows[1] = 0;
+    if(src.width <= 0 || src.height <= 0 || dst.width <= 0 || dst.height <= 0)
+        return;
+    int sw = src.width, sh = src.height;
+    int dw = dst.width, dh = dst.height;
+
+    resampleAxis ax, ay;
+    resampleWeights(sw, dw, method, ax);
+    resampleWeights(sh, dh, method, ay);
+
+    //windows start in increasing order, so the rows reading the range are contiguous
+    int top = 0, bottom = dh;
+    while(top < dh && ay.start[top] + ay.taps <= srcTop)
+        top++;
+    while(bottom > top && ay.start[bottom-1] >= srcBottom)
+        bottom--;
+    if(dstRows){
+        dstRows[0] = top;
+        dstRows[1] = bottom;
+    }
+    if(top >= bottom)
+        return;
+
+    //bands of destination rows, each one filters the source rows it needs
+    int bands = std::min(bottom - top, workers.size()*4);
+    int bandRows = (bottom - top + bands - 1) / bands;
+    workers.run(bands, [&](int band){
+        int y0 = top + band*bandRows;
+        int y1 = std::min(bottom, y0 + bandRows);
+        if(y0 >= y1)
+            return;
+        int r0 = ay.start[y0];
+        int r1 = ay.start[y1-1] + ay.taps;
+
+        scratchArena arena((size_t)(r1 - r0)*dw*sizeof(float) + (size_t)dw*(sizeof(float) + 1) + sw + 64);
+        float *rows = arena.alloc<float>((size_t)(r1 - r0)*dw);
+        float *acc = arena.alloc<float>(dw);
+        unsigned char *line = arena.alloc<unsigned char>(std::max(sw, dw));
+
+        //horizontal pass: fixed length dot product per destination pixel
+        for(int r = r0; r < r1; r++){
+            getGrayRect(src, 0, r, sw, 1, line);
+            float *out = rows + (size_t)(r - r0)*dw;
+            for(int x = 0; x < dw; x++){
+                const unsigned char *p = line + ax.start[x];
+                const float *wx = &ax.weight[(size_t)x*ax.taps];
+                float sum = 0;
+                for(int k = 0; k < ax.taps; k++)
+                    sum += wx[k]*p[k];
+                out[x] = sum;
+            }
+        }
+
+        //vertical pass: whole rows scaled and added
+        for(int y = y0; y < y1; y++){
+            const float *wy = &ay.weight[(size_t)y*ay.taps];
+            const float *in = rows + (size_t)(ay.start[y] - r0)*dw;
+            for(int x = 0; x < dw; x++)
+                acc[x] = 0;
+            for(int k = 0; k < ay.taps; k++){
+                float c = wy[k];
+                const float *row = in + (size_t)k*dw;
+                for(int x = 0; x < dw; x++)
+                    acc[x] += c*row[x];
+            }
+
+            //8 bit limit (kernels with negative lobes overshoot)
+            for(int x = 0; x < dw; x++){
+                float v = acc[x] + 0.5f;
+                line[x] = v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (unsigned char)v);
+            }
+            setGrayRect(dst, 0, y, dw, 1, line);
+        }
+    });
+}
+
+/////////////////////////////////////////////////////////////////////Selection masks
+
+/*append a span, it must start after the previous one (touching spans of a row are merged)*/
+bool spanMask::add(int y, int x, int length){
+    if(length <= 0 || y < 0 || x < 0)
+        return false;
+    if(!spans.empty()){
+        span &previous = spans.back();
+        if(y < previous.y || (y == previous.y && x < previous.x + previous.length))
+            return false;
+        if(y == previous.y && x == previous.x + previous.length){
+            previous.length += length;
+            right = std::max(right, x + length);
+            pixels += length;
+            return true;
+        }
+    }
+
+    if(spans.empty()){
+        left = x;
+        top = y;
+        right = x + length;
+    }
+    left = std::min(left, x);
+    right = std::max(right, x + length);
+    bottom = y + 1;
+    pixels += length;
+    spans.push_back({y, x, length});
+    return true;
+}
+
+/*every pixel of a rectangle*/
+spanMask spanMask::rectangle(int x, int y, int w, int h){
+    spanMask mask;
+    for(int i = 0; i < h; i++)
+        mask.add(y + i, x, w);
+    return mask;
+}
+
+/*pixels of a rectangle with gray value between low and high*/
+spanMask spanMask::threshold(grayView image, int x, int y, int w, int h, int low, int high){
+    spanMask mask;
+    for(int i = 0; i < h; i++){
+        const unsigned char *row = image.data + image.channels*((size_t)(y+i)*image.stride + x);
+        int start = -1;
+        for(int j = 0; j <= w; j++){
+            bool inside = j < w && row[image.channels*j] >= low && row[image.channels*j] <= high;
+            if(inside && start < 0)
+                start = j;
+            else if(!inside && start >= 0){
+                mask.add(y + i, x + start, j - start);
+                start = -1;
+            }
+        }
+    }
+    return mask;
+}
+
+/*pixels whose centers fall inside a closed polygon (x, y pairs, even-odd rule), clipped to the image*/
+spanMask spanMask::polygon(const std::vector<int> &points, int width, int height){
+    spanMask mask;
+    int n = points.size() / 2;
+    if(n < 3)
+        return mask;
+    int minY = height, maxY = 0;
+    for(int i = 0; i < n; i++){
+        minY = std::min(minY, points[2*i+1]);
+        maxY = std::max(maxY, points[2*i+1]);
+    }
+
+    std::vector<double> crossings;
+    for(int py = std::max(0, minY); py < std::min(height, maxY + 1); py++){
+        double center = py + 0.5;
+        crossings.clear();
+        for(int i = 0; i < n; i++){
+            double x0 = points[2*i], y0 = points[2*i+1];
+            double x1 = points[2*((i+1)%n)], y1 = points[2*((i+1)%n)+1];
+            if((y0 <= center) != (y1 <= center))
+                crossings.push_back(x0 + (center - y0)*(x1 - x0)/(y1 - y0));
+        }
+        std::sort(crossings.begin(), crossings.end());
+        for(size_t i = 0; i + 1 < crossings.size(); i += 2){
+            int start = std::max(0, (int)ceil(crossings[i] - 0.5));
+            int end = std::min(width, (int)ceil(crossings[i+1] - 0.5));
+            if(start < end)
+                mask.add(py, start, end - start);
+        }
+    }
+    return mask;
+}
+
+/*copy the selected pixels of an image, span after span*/
+void spanMask::gather(grayView image, unsigned char *gray) const{
+    for(size_t i = 0; i < spans.size(); i++){
+        getGrayRect(image, spans[i].x, spans[i].y, spans[i].length, 1, gray);
+        gray += spans[i].length;
+    }
+}
+
+/*write gathered pixels back over the selection*/
+void spanMask::scatter(grayView image, const unsigned char *gray) const{
+    for(size_t i = 0; i < spans.size(); i++){
+        setGrayRect(image, spans[i].x, spans[i].y, spans[i].length, 1, gray);
+        gray += spans[i].length;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////PGM files
+
+/*next decimal number of the file skipping blanks and comments, -1 at the end*/
+int pgmReader::readNumber(){
+    int c = getc_unlocked(file);
+    while(c != EOF && (isspace(c) || c == '#')){
+        if(c == '#'){
+            while(c != EOF && c != '\n')
+                c = getc_unlocked(file);
+        }
+        c = getc_unlocked(file);
+    }
+    if(c == EOF || !isdigit(c))
+        return -1;
+
+    int value = 0;
+    while(c != EOF && isdigit(c)){
+        value = value*10 + (c - '0');
+        c = getc_unlocked(file);
+    }
+    return value;
+}
+
+/*open a PGM file and read its header*/
+bool pgmReader::open(const char *path){
+    close();
+    file = fopen(path, "rb");
+    if(!file)
+        return false;
+
+    char magic[2];
+    if(fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || (magic[1] != '2' && magic[1] != '5')){
+        close();
+        return false;
+    }
+    binary = magic[1] == '5';
+    width = readNumber();
+    height = readNumber();
+    maxValue = readNumber();
+    if(width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 65535){
+        close();
+        return false;
+    }
+    dataOffset = ftell(file);
+    return true;
+}
+
+/*decode the next rows of the image into a gray buffer*/
+bool pgmReader::readRows(unsigned char *gray, int rows){
+    if(!file)
+        return false;
+
+    size_t count = (size_t)rows*width;
+    if(binary && maxValue < 256){
+        if(fread(gray, 1, count, file) != count)
+            return false;
+        if(maxValue != 255){
+            for(size_t i = 0; i < count; i++)
+                gray[i] = std::min(255, gray[i]*255/maxValue);
+        }
+        return true;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        int value;
+        if(binary){
+            int high = getc_unlocked(file);
+            int low = getc_unlocked(file);
+            if(low == EOF)
+                return false;
+            value = (high << 8) | low;
+        }else{
+            value = readNumber();
+            if(value < 0)
+                return false;
+        }
+        gray[i] = std::min(255, value*255/maxValue);
+    }
+    return true;
+}
+
+/*read every step-th row of a binary file one after another, then go back to the first row*/
+bool pgmReader::readSampledRows(unsigned char *gray, int step){
+    if(!file || !binary || step < 1)
+        return false;
+
+    long rowBytes = (long)width*(maxValue < 256 ? 1 : 2);
+    bool ok = true;
+    for(int r = 0; ok && r < height; r += step){
+        ok = fseek(file, dataOffset + r*rowBytes, SEEK_SET) == 0 && readRows(gray, 1);
+        gray += width;
+    }
+    return fseek(file, dataOffset, SEEK_SET) == 0 && ok;
+}
+
+void pgmReader::close(){
+    if(file)
+        fclose(file);
+    file = nullptr;
+}
+
+/*read the header and start decoding rows on the background thread*/
+bool pgmLoader::start(const char *path){
+    stop();
+    if(!reader.open(path))
+        return false;
+
+    width = reader.width;
+    height = reader.height;
+    gray = patchBuffer((size_t)width*height);
+    preview = patchBuffer();
+    rowsDone = 0;
+    previewReady = false;
+    failed = false;
+    cancel = false;
+    thread = std::thread(&pgmLoader::decode, this);
+    return true;
+}
+
+/*cancel the decoding in progress and wait for the thread*/
+void pgmLoader::stop(){
+    cancel = true;
+    if(thread.joinable())
+        thread.join();
+    reader.close();
+}
+
+void pgmLoader::decode(){
+    if(reader.seekable() && height > PREVIEWROWS){
+        int step = height / PREVIEWROWS;
+        patchBuffer sample((size_t)width*((height + step - 1) / step));
+        if(reader.readSampledRows(sample.data(), step)){
+            preview = sample;
+            previewStep = step;
+            previewReady = true;
+        }
+    }
+
+    //rows from top to bottom, published a chunk at a time
+    int row = 0;
+    while(row < height && !cancel){
+        int rows = std::min(LOADCHUNK, height - row);
+        if(!reader.readRows(gray.data() + (size_t)row*width, rows)){
+            failed = true;
+            break;
+        }
+        row += rows;
+        rowsDone = row;
+    }
+    reader.close();
+}
+
+/*write a gray buffer as a binary PGM (P5)*/
+bool writePGM(const char *path, const unsigned char *gray, int w, int h){
+    FILE *out = fopen(path, "wb");
+    if(!out)
+        return false;
+    bool ok = fprintf(out, "P5\n%d %d\n255\n", w, h) > 0 &&
+                fwrite(gray, 1, (size_t)w*h, out) == (size_t)w*h;
+    return (fclose(out) == 0) && ok;
+}
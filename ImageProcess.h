@@ -0,0 +1,923 @@
+/* Operaciones sobre parches de imagenes en escala de gris, compartidas por
+    la interfaz (PyA_Final.cpp) y el servidor de procesamiento (ProcessServer.cpp):
+
+        -Memoria de parches y de trabajo tomada de un pool por clases de tamano.
+
+        -Hilos de trabajo compartidos para operar por bandas.
+
+        -Filtros aplicados sobre un parche con su copia previa para deshacer.
+
+        -Cache de resultados para no repetir una operacion sobre el mismo parche.
+
+        -Cambio de tamano separable para la vista y la operacion de escalado.
+
+        -Selecciones de forma libre (lazo o umbral) guardadas como tramos por fila.
+
+        -Lectura y escritura de archivos PGM sin depender de wxWidgets, con carga
+        progresiva en segundo plano.
+*/
+
+#ifndef IMAGEPROCESS_H
+#define IMAGEPROCESS_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <sys/mman.h>
+
+#define POOLCLASSES 28                  //power of two size classes kept by the buffer pool
+#define POOLMINBLOCK 64                 //bytes of the smallest pool size class
+#define POOLKEEP 8                      //free buffers kept for reuse on every size class
+#define POOLCACHEBYTES (32 << 20)       //free bytes kept by the buffer pool at most
+#define POOLLARGEBLOCK (8 << 20)        //blocks larger than this go back to the system when released
+#define CACHEBYTES (64 << 20)           //patch bytes kept by the result cache
+#define CACHEENTRIES 64                 //results kept by the result cache
+#define BILATERALCELLS (4 << 20)        //cells of a bilateral grid at most (coarser sampling beyond)
+#define LOADCHUNK 16                    //rows decoded between progress updates of a loading image
+#define PREVIEWROWS 64                  //rows sampled for the first view of a loading image
+#define MASKTILE 128                    //side of the blocks a selection is filtered in
+
+/////////////////////////////////////////////////////////////////////Buffer pool
+
+/*size-class pool reusing gray buffers of patches, history and scratch memory*/
+class bufferPool{
+    private:
+        struct freeList{
+            void *blocks[POOLKEEP];
+            int count;
+        };
+        freeList classes[POOLCLASSES];  //free blocks per power of two size class
+        std::mutex lock;                //pool is shared by worker threads
+
+        /*smallest power of two class holding the requested bytes*/
+        static int sizeClass(size_t bytes){
+            int c = 0;
+            while(((size_t)POOLMINBLOCK << c) < bytes)
+                c++;
+            return c;
+        }
+
+    public:
+        //allocation counters
+        long requests = 0;      //blocks asked to the pool
+        long reused = 0;        //requests served from a free list
+        long allocations = 0;   //requests that reached the system allocator
+        size_t bytesInUse = 0;  //bytes held by live buffers
+        size_t bytesCached = 0; //bytes kept in free lists
+
+        bufferPool(){
+            for(int i = 0; i < POOLCLASSES; i++)
+                classes[i].count = 0;
+        }
+
+        ~bufferPool(){
+            for(int i = 0; i < POOLCLASSES; i++)
+                for(int j = 0; j < classes[i].count; j++)
+                    free(classes[i].blocks[j]);
+        }
+
+        /*get a block of at least the requested bytes, returns its real capacity (throws std::bad_alloc)*/
+        void *acquire(size_t bytes, size_t &capacity){
+            int c = sizeClass(bytes);
+            capacity = (size_t)POOLMINBLOCK << c;
+            bool large = capacity > POOLLARGEBLOCK;
+            if(large)
+                capacity = bytes;   //never kept by the pool, so it is not rounded up
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                requests++;
+                bytesInUse += capacity;
+                if(!large && c < POOLCLASSES && classes[c].count > 0){
+                    reused++;
+                    bytesCached -= capacity;
+                    return classes[c].blocks[--classes[c].count];
+                }
+                allocations++;
+            }
+
+            void *block = malloc(capacity);
+            if(!block){
+                std::lock_guard<std::mutex> guard(lock);
+                bytesInUse -= capacity;
+                throw std::bad_alloc();
+            }
+            return block;
+        }
+
+        /*give a block back, small blocks are kept for reuse while their class and the pool have room*/
+        void release(void *block, size_t capacity){
+            int c = sizeClass(capacity);
+
+            std::lock_guard<std::mutex> guard(lock);
+            bytesInUse -= capacity;
+            if(c < POOLCLASSES && classes[c].count < POOLKEEP && capacity <= POOLLARGEBLOCK &&
+                bytesCached + capacity <= POOLCACHEBYTES){
+                classes[c].blocks[classes[c].count++] = block;
+                bytesCached += capacity;
+                return;
+            }
+            free(block);
+        }
+
+        /*return every free block to the system*/
+        void trim(){
+            std::lock_guard<std::mutex> guard(lock);
+            for(int i = 0; i < POOLCLASSES; i++){
+                for(int j = 0; j < classes[i].count; j++)
+                    free(classes[i].blocks[j]);
+                classes[i].count = 0;
+            }
+            bytesCached = 0;
+        }
+};
+
+extern bufferPool patchPool;    //pool shared by every patch of the program
+
+/*private memory mapping of a file, unmapped when the last view over it is released*/
+struct mappedFile{
+    unsigned char *data;
+    size_t size;
+
+    mappedFile(unsigned char *mapping, size_t length){
+        data = mapping;
+        size = length;
+    }
+
+    ~mappedFile(){
+        munmap(data, size);
+    }
+};
+
+/*reference counted gray buffer taken from the pool (copies share the same pixels)*/
+class patchBuffer{
+    private:
+        //header stored at the start of the pooled block
+        struct block{
+            std::atomic<int> refs;
+            size_t capacity;
+            size_t size;
+            unsigned char *external;            //pixels living in a mapped file instead of the block
+            std::shared_ptr<mappedFile> file;   //keeps that mapping alive
+        };
+        block *b;
+
+        static constexpr size_t HEADER = (sizeof(block) + 15) & ~(size_t)15;
+
+        void unref(){
+            if(b && --b->refs == 0){
+                size_t capacity = b->capacity;
+                b->~block();
+                patchPool.release(b, capacity);
+            }
+            b = nullptr;
+        }
+
+    public:
+        patchBuffer(){
+            b = nullptr;
+        }
+
+        explicit patchBuffer(size_t size){
+            size_t capacity;
+            void *mem = patchPool.acquire(HEADER + size, capacity);
+            b = new (mem) block();
+            b->refs = 1;
+            b->capacity = capacity;
+            b->size = size;
+            b->external = nullptr;
+        }
+
+        patchBuffer(const patchBuffer &other){
+            b = other.b;
+            if(b)
+                b->refs++;
+        }
+
+        patchBuffer &operator=(const patchBuffer &other){
+            if(other.b)
+                other.b->refs++;
+            unref();
+            b = other.b;
+            return *this;
+        }
+
+        ~patchBuffer(){
+            unref();
+        }
+
+        /*buffer over pixels already present in a mapped file, pages are read only when used*/
+        static patchBuffer view(std::shared_ptr<mappedFile> file, size_t offset, size_t size){
+            patchBuffer buffer(0);
+            buffer.b->size = size;
+            buffer.b->external = file->data + offset;
+            buffer.b->file = file;
+            return buffer;
+        }
+
+        unsigned char *data() const{
+            if(!b)
+                return nullptr;
+            return b->external ? b->external : (unsigned char*)b + HEADER;
+        }
+
+        size_t size() const{
+            return b ? b->size : 0;
+        }
+
+        bool isNull() const{
+            return b == nullptr;
+        }
+
+        bool isMapped() const{
+            return b && b->external;
+        }
+
+        /*pixels also referenced by another buffer*/
+        bool isShared() const{
+            return b && b->refs > 1;
+        }
+
+        bool sameAs(const patchBuffer &other) const{
+            return b && b == other.b;
+        }
+};
+
+/*per operation bump allocator for scratch rows, memory returns to the pool when it goes out of scope*/
+class scratchArena{
+    private:
+        patchBuffer memory;
+        size_t used;
+
+    public:
+        scratchArena(size_t bytes) : memory(bytes){
+            used = 0;
+        }
+
+        template<typename T> T *alloc(size_t count){
+            size_t bytes = (count*sizeof(T) + 15) & ~(size_t)15;
+            if(used + bytes > memory.size())
+                return nullptr;
+            T *ptr = (T*)(memory.data() + used);
+            used += bytes;
+            return ptr;
+        }
+};
+
+/*gray pixels of an image in memory, every channel of a pixel holds the same value*/
+struct grayView{
+    unsigned char *data;
+    int width, height;
+    int stride;         //pixels between the start of two rows
+    int channels;       //bytes per pixel
+};
+
+void getGrayRect(grayView image, int x, int y, int w, int h, unsigned char *gray);
+void setGrayRect(grayView image, int x, int y, int w, int h, const unsigned char *gray);
+void padRow(const unsigned char *row, int w, int pad, unsigned char *padded);
+
+/*ring of padded patch rows around the current one, every source row is padded only once*/
+class rowWindow{
+    private:
+        const unsigned char *src;   //gray patch
+        int w, h;                   //patch size
+        int pad;                    //pixels replicated at each side of a row
+        int count;                  //rows kept in the ring
+        unsigned char **ring;       //padded rows
+        int *ringRow;               //patch row stored in each ring slot
+
+    public:
+        rowWindow(scratchArena &arena, const unsigned char *source, int width, int height, int padding, int rows){
+            src = source;
+            w = width;
+            h = height;
+            pad = padding;
+            count = rows;
+            ring = arena.alloc<unsigned char*>(rows);
+            ringRow = arena.alloc<int>(rows);
+            for(int i = 0; i < rows; i++){
+                ring[i] = arena.alloc<unsigned char>(w + 2*pad);
+                ringRow[i] = -1;
+            }
+        }
+
+        /*padded row r (clamped to the patch), index 0 is the pixel at x = -pad*/
+        const unsigned char *row(int r){
+            r = r < 0 ? 0 : (r >= h ? h-1 : r);
+            int slot = r % count;
+            if(ringRow[slot] != r){
+                padRow(src + (size_t)r*w, w, pad, ring[slot]);
+                ringRow[slot] = r;
+            }
+            return ring[slot];
+        }
+
+        /*scratch bytes needed by a window of the given size*/
+        static size_t bytes(int width, int padding, int rows){
+            return (size_t)rows*(width + 2*padding + 16 + sizeof(void*) + sizeof(int) + 32);
+        }
+};
+
+/////////////////////////////////////////////////////////////////////Worker pool
+
+/*fixed set of threads splitting an operation in bands, the calling thread works too*/
+class workerPool{
+    private:
+        std::vector<std::thread> threads;
+        std::mutex jobLock;                 //one job at a time
+        std::mutex lock;                    //guards the job state
+        std::condition_variable wake;       //signals a new job to the workers
+        std::condition_variable finished;   //signals the caller when every band is done
+        const std::function<void(int)> *job;
+        int bands;                          //bands of the current job
+        int nextBand;                       //next band to take
+        int doneBands;                      //bands already processed
+        long generation;                    //job counter, wakes workers only once per job
+        bool stopping;
+
+        /*take bands of the current job until none is left*/
+        void work(std::unique_lock<std::mutex> &guard){
+            while(nextBand < bands){
+                int band = nextBand++;
+                guard.unlock();
+                (*job)(band);
+                guard.lock();
+                if(++doneBands == bands)
+                    finished.notify_all();
+            }
+        }
+
+        void workerLoop(){
+            long seen = 0;
+            std::unique_lock<std::mutex> guard(lock);
+            while(true){
+                wake.wait(guard, [&]{return stopping || generation != seen;});
+                if(stopping)
+                    return;
+                seen = generation;
+                work(guard);
+            }
+        }
+
+    public:
+        workerPool(){
+            job = nullptr;
+            bands = nextBand = doneBands = 0;
+            generation = 0;
+            stopping = false;
+        }
+
+        ~workerPool(){
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for(size_t i = 0; i < threads.size(); i++)
+                threads[i].join();
+        }
+
+        /*threads taking part in a job (workers are started on first use)*/
+        int size(){
+            std::lock_guard<std::mutex> guard(lock);
+            if(threads.empty()){
+                int n = std::thread::hardware_concurrency();
+                for(int i = 1; i < (n > 1 ? n : 1); i++)
+                    threads.push_back(std::thread(&workerPool::workerLoop, this));
+            }
+            return threads.size() + 1;
+        }
+
+        /*run task(band) for every band and wait for all of them*/
+        void run(int bandCount, const std::function<void(int)> &task){
+            size();
+            std::lock_guard<std::mutex> single(jobLock);
+            std::unique_lock<std::mutex> guard(lock);
+            job = &task;
+            bands = bandCount;
+            nextBand = doneBands = 0;
+            generation++;
+            wake.notify_all();
+
+            work(guard);
+            finished.wait(guard, [&]{return doneBands == bands;});
+            job = nullptr;
+            bands = 0;
+        }
+};
+
+extern workerPool workers;      //threads shared by every parallel operation
+
+/////////////////////////////////////////////////////////////////////Resampling
+
+/*kernels used on enlarged axes, reduced axes always average the covered area*/
+enum{
+    RESAMPLE_AREA = 0,
+    RESAMPLE_BILINEAR = 1,
+    RESAMPLE_BICUBIC = 2,
+    RESAMPLE_LANCZOS = 3
+};
+
+void resampleGray(grayView src, grayView dst, int method, int srcTop = 0, int srcBottom = INT_MAX,
+                    int *dstRows = nullptr);
+
+/////////////////////////////////////////////////////////////////////Selection masks
+
+/*selection of any shape stored as runs of pixels (spans) per row, from top to bottom and left to right*/
+class spanMask{
+    public:
+        struct span{
+            int32_t y, x, length;
+        };
+
+    private:
+        std::vector<span> spans;
+        int left, top, right, bottom;   //bounding box (right and bottom excluded)
+        size_t pixels;                  //selected pixels
+
+    public:
+        spanMask(){
+            left = top = right = bottom = 0;
+            pixels = 0;
+        }
+
+        bool add(int y, int x, int length);
+        static spanMask rectangle(int x, int y, int w, int h);
+        static spanMask threshold(grayView image, int x, int y, int w, int h, int low, int high);
+        static spanMask polygon(const std::vector<int> &points, int width, int height);
+        void gather(grayView image, unsigned char *gray) const;
+        void scatter(grayView image, const unsigned char *gray) const;
+
+        const std::vector<span> &getSpans() const{
+            return spans;
+        }
+
+        size_t area() const{
+            return pixels;
+        }
+
+        bool isEmpty() const{
+            return pixels == 0;
+        }
+
+        int getLeft() const{
+            return left;
+        }
+
+        int getTop() const{
+            return top;
+        }
+
+        int getWidth() const{
+            return right - left;
+        }
+
+        int getHeight() const{
+            return bottom - top;
+        }
+};
+
+/////////////////////////////////////////////////////////////////////Result cache
+
+uint64_t patchHash(const unsigned char *data, size_t size, uint64_t seed);
+
+/*least recently used results of operations, keyed by a hash of the input patch, the operation and its
+  parameters. Input and output are the same buffers held by the history, so a hit costs no copy*/
+class resultCache{
+    private:
+        struct entry{
+            uint64_t key;
+            int op_ID;
+            int w, h;
+            double param[2];
+            patchBuffer input;      //pre-filtered patch the result was computed from
+            patchBuffer output;     //filtered patch
+        };
+        std::list<entry> order;                                         //most recently used first
+        std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+        std::mutex lock;
+
+        void evict(){
+            entry &last = order.back();
+            bytes -= last.input.size() + last.output.size();
+            index.erase(last.key);
+            order.pop_back();
+        }
+
+        void erase(std::list<entry>::iterator it){
+            bytes -= it->input.size() + it->output.size();
+            index.erase(it->key);
+            order.erase(it);
+        }
+
+        /*bytes of a buffer only the cache keeps alive*/
+        static size_t ownBytes(const patchBuffer &buffer){
+            return buffer.isShared() || buffer.isMapped() ? 0 : buffer.size();
+        }
+
+    public:
+        //cache counters
+        long hits = 0;
+        long misses = 0;
+        size_t bytes = 0;   //patch bytes referenced by the cache (shared with the history)
+
+        /*previous result of the operation over identical pixels, the input is compared to rule out collisions*/
+        bool find(uint64_t key, int op_ID, int w, int h, const double *param, const patchBuffer &input,
+                    patchBuffer &output){
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if(it != index.end()){
+                entry &e = *it->second;
+                if(e.op_ID == op_ID && e.w == w && e.h == h && e.param[0] == param[0] && e.param[1] == param[1] &&
+                    e.input.size() == input.size() && memcmp(e.input.data(), input.data(), input.size()) == 0){
+                    order.splice(order.begin(), order, it->second);
+                    output = e.output;
+                    hits++;
+                    return true;
+                }
+            }
+            misses++;
+            return false;
+        }
+
+        /*keep a result, dropping the least recently used ones over the limits*/
+        void insert(uint64_t key, int op_ID, int w, int h, const double *param, const patchBuffer &input,
+                    const patchBuffer &output){
+            size_t size = input.size() + output.size();
+            if(size > CACHEBYTES)
+                return;
+
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if(it != index.end()){
+                bytes -= it->second->input.size() + it->second->output.size();
+                order.erase(it->second);
+                index.erase(it);
+            }
+            while(!order.empty() && (bytes + size > CACHEBYTES || order.size() >= CACHEENTRIES))
+                evict();
+
+            order.push_front(entry{key, op_ID, w, h, {param[0], param[1]}, input, output});
+            index[key] = order.begin();
+            bytes += size;
+        }
+
+        void clear(){
+            std::lock_guard<std::mutex> guard(lock);
+            order.clear();
+            index.clear();
+            bytes = 0;
+        }
+
+        /*drop the results computed from or into a buffer (a history being released)*/
+        void forget(const patchBuffer &buffer){
+            std::lock_guard<std::mutex> guard(lock);
+            for(auto it = order.begin(); it != order.end();){
+                auto next = std::next(it);
+                if(it->input.sameAs(buffer) || it->output.sameAs(buffer))
+                    erase(it);
+                it = next;
+            }
+        }
+
+        /*bytes only the cache keeps in memory (the rest is shared with histories)*/
+        size_t ownedBytes(){
+            std::lock_guard<std::mutex> guard(lock);
+            size_t owned = 0;
+            for(const entry &e : order)
+                owned += ownBytes(e.input) + ownBytes(e.output);
+            return owned;
+        }
+
+        /*drop the results no history shares, their memory is released*/
+        void dropOwned(){
+            std::lock_guard<std::mutex> guard(lock);
+            for(auto it = order.begin(); it != order.end();){
+                auto next = std::next(it);
+                if(!it->input.isShared() && !it->output.isShared())
+                    erase(it);
+                it = next;
+            }
+        }
+
+        size_t entries(){
+            std::lock_guard<std::mutex> guard(lock);
+            return order.size();
+        }
+};
+
+extern resultCache results;     //results shared by every operation of the program
+
+/*operation identifiers, stored in journals and projects (new operations go at the end)*/
+enum{
+    OP_SOBEL = 0,
+    OP_NEGATIVE = 1,
+    OP_GAUSS = 2,
+    OP_CONTRAST = 3,
+    OP_CANNY = 4,
+    OP_ERODE = 5,
+    OP_DILATE = 6,
+    OP_OPEN = 7,
+    OP_CLOSE = 8,
+    OP_TOPHAT = 9,
+    OP_RESIZE = 10,
+    OP_CLAHE = 11,
+    OP_BILATERAL = 12,
+    OP_COUNT
+};
+
+/*operations applied to image patches*/
+class ImageProcess{
+    private:
+        patchBuffer patch;      //filtered image area (gray, taken from the pool)
+        patchBuffer old_patch;  //pre-filtered image area (gray, taken from the pool)
+        int op_ID;              //index of operation applied
+        double param[2];        //operation parameters (contrast alpha-beta, canny thresholds...)
+        int x, y;               //patch upperleft corner coordinate
+        int w, h;               //patch size
+        int rw, rh;             //filtered patch size (differs from w, h only on resize)
+        std::shared_ptr<const spanMask> mask;  //selected pixels, patches hold only them (null for a rectangle)
+        bool empty;             //verify if patch is allocated
+
+        void canny_band(unsigned char *label, int y0, int y1, int low, int high);
+        void morphology(const unsigned char *src, unsigned char *dst, bool dilate);
+        void filter();
+
+    public:
+        //constructors
+        ImageProcess(){
+            op_ID = 0;
+            param[0] = param[1] = 0;
+            x = y = w = h = 0;
+            rw = rh = 0;
+            empty = true;
+        }
+
+        ImageProcess(grayView image, int operation, int x_coord, int y_coord, int width,int height,
+                        double param1 = 0, double param2 = 0){
+            op_ID = operation; 
+            param[0] = param1;
+            param[1] = param2;
+            w = width;
+            h = height;
+            x = x_coord;
+            y = y_coord;
+            //resize always takes the whole image
+            if(op_ID == OP_RESIZE){
+                x = y = 0;
+                w = image.width;
+                h = image.height;
+            }
+            resultSize(op_ID,w,h,param,rw,rh);
+            //copy pre-filtered area, filtered area is written (or found in the cache) by process
+            old_patch = patchBuffer((size_t)w*h);
+            getGrayRect(image,x,y,w,h,old_patch.data());
+            empty = false;
+        }
+
+        ImageProcess(grayView image, int operation, std::shared_ptr<const spanMask> selection,
+                        double param1 = 0, double param2 = 0){
+            //operation over the pixels of a selection, the patch area is its bounding box
+            op_ID = operation;
+            param[0] = param1;
+            param[1] = param2;
+            x = selection->getLeft();
+            y = selection->getTop();
+            rw = w = selection->getWidth();
+            rh = h = selection->getHeight();
+            mask = selection;
+            old_patch = patchBuffer(mask->area());
+            mask->gather(image,old_patch.data());
+            empty = false;
+        }
+
+        ImageProcess(int operation, int x_coord, int y_coord, int width, int height,
+                        double param1, double param2, patchBuffer filtered, patchBuffer original,
+                        std::shared_ptr<const spanMask> selection = nullptr){
+            //operation read back from a saved history
+            op_ID = operation;
+            param[0] = param1;
+            param[1] = param2;
+            w = width;
+            h = height;
+            x = x_coord;
+            y = y_coord;
+            resultSize(op_ID,w,h,param,rw,rh);
+            mask = selection;
+            patch = filtered;
+            old_patch = original;
+            empty = false;
+        }
+
+        //getters
+        bool getPatchState(){
+            return empty;
+        }
+
+        int getOpID(){
+            return op_ID;
+        }
+
+        double getParam(int i){
+            return param[i];
+        }
+
+        int getX(){
+            return x;
+        }
+
+        int getY(){
+            return y;
+        }
+
+        int getWidth(){
+            return w;
+        }
+
+        int getHeight(){
+            return h;
+        }
+
+        int getResultWidth(){
+            return rw;
+        }
+
+        int getResultHeight(){
+            return rh;
+        }
+
+        const unsigned char *getPatchData(int patch_mode){
+            return patch_mode ? patch.data() : old_patch.data();
+        }
+
+        /*bytes of the filtered (1) or pre-filtered (0) patch, only the selected pixels on a selection*/
+        size_t getPatchSize(int patch_mode){
+            if(mask)
+                return mask->area();
+            return patch_mode ? (size_t)rw*rh : (size_t)w*h;
+        }
+
+        bool isMasked(){
+            return mask != nullptr;
+        }
+
+        std::shared_ptr<const spanMask> getMask(){
+            return mask;
+        }
+
+        /*drop cached results over the patches of this operation so they are released with it*/
+        void forgetResults() const{
+            results.forget(old_patch);
+            results.forget(patch);
+        }
+
+        /*bytes of both patches held in memory (views over a mapped file are not counted)*/
+        size_t memoryBytes(){
+            return (patch.isMapped() ? 0 : patch.size()) + (old_patch.isMapped() ? 0 : old_patch.size());
+        }
+
+
+        /*size of the filtered patch of an operation over a patch of width x height*/
+        static void resultSize(int operation, int width, int height, const double *params,
+                                int &resultW, int &resultH){
+            resultW = width;
+            resultH = height;
+            if(operation == OP_RESIZE){
+                //params: scale (percent), interpolation used when enlarging
+                resultW = std::max(1, (int)(width*params[0]/100.0 + 0.5));
+                resultH = std::max(1, (int)(height*params[0]/100.0 + 0.5));
+            }
+        }
+
+        /*pixels around a block an operation reads (0 pointwise, -1 when it depends on the whole area)*/
+        static int haloSize(int operation, const double *params){
+            switch(operation){
+                case OP_NEGATIVE:
+                case OP_CONTRAST:
+                    return 0;
+                case OP_SOBEL:
+                    return 1;
+                case OP_GAUSS:
+                    return 2;
+                case OP_ERODE:
+                case OP_DILATE:
+                    return std::max(1, (int)std::max(params[0], params[1]));
+                case OP_OPEN:
+                case OP_CLOSE:
+                case OP_TOPHAT:
+                    return 2*std::max(1, (int)std::max(params[0], params[1]));
+                case OP_BILATERAL:
+                    //grid blur and slicing reach about three cells of sigma spatial
+                    return 3*std::max(1, (int)params[0]) + 1;
+                default:
+                    return -1;
+            }
+        }
+
+        //image processing methods
+        void setPatchImage(grayView image, int patch_mode);
+        void process();
+        void process(grayView image);
+        void gauss_filter();
+        void sobel_filter();
+        void constrast();
+        void negative();
+        void canny_filter();
+        void erosion();
+        void dilation();
+        void opening();
+        void closing();
+        void top_hat();
+        void resize();
+        void clahe();
+        void bilateral();
+};
+
+
+/////////////////////////////////////////////////////////////////////PGM files
+
+/*PGM reader (P2 ascii or P5 binary) decoding rows on demand, values scaled to 0-255*/
+class pgmReader{
+    private:
+        FILE *file;
+        bool binary;        //P5 format
+        int maxValue;       //largest sample value declared in the header
+        long dataOffset;    //file position of the first sample
+
+        int readNumber();
+
+    public:
+        int width, height;  //image size read from the header
+
+        pgmReader(){
+            file = nullptr;
+            width = height = 0;
+        }
+
+        ~pgmReader(){
+            close();
+        }
+
+        bool open(const char *path);
+        bool readRows(unsigned char *gray, int rows);
+        bool readSampledRows(unsigned char *gray, int step);
+        void close();
+
+        /*rows can be read out of order (binary samples have a fixed size)*/
+        bool seekable(){
+            return binary;
+        }
+};
+
+/*decodes a PGM on a background thread, rows become available from top to bottom.
+  Files that can seek get a preview of sampled rows over the whole image first*/
+class pgmLoader{
+    private:
+        pgmReader reader;
+        std::thread thread;
+        std::atomic<bool> cancel;
+
+        void decode();
+
+    public:
+        patchBuffer gray;                   //pixels of the whole image
+        patchBuffer preview;                //every previewStep-th row of the image
+        int previewStep;
+        std::atomic<int> rowsDone;          //rows of gray already decoded
+        std::atomic<bool> previewReady;
+        std::atomic<bool> failed;
+        int width, height;
+
+        pgmLoader() : cancel(false), rowsDone(0), previewReady(false), failed(false){
+            width = height = 0;
+            previewStep = 1;
+        }
+
+        ~pgmLoader(){
+            stop();
+        }
+
+        bool start(const char *path);
+        void stop();
+
+        bool finished(){
+            return failed || rowsDone == height;
+        }
+};
+
+bool writePGM(const char *path, const unsigned char *gray, int w, int h);
+
+#endif
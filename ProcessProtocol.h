@@ -0,0 +1,226 @@
+/* Protocolo del servidor de procesamiento (ProcessServer.cpp):
+
+        -Los mensajes viajan por un socket local (AF_UNIX, SOCK_SEQPACKET),
+        una solicitud o respuesta por mensaje.
+
+        -Los pixeles nunca viajan por el socket, el servidor entrega un
+        descriptor de memoria compartida (un byte por pixel, fila por fila)
+        que el cliente mapea para leer y escribir la imagen sin copias.
+
+        -processClient es un cliente minimo para herramientas externas.
+*/
+
+#ifndef PROCESSPROTOCOL_H
+#define PROCESSPROTOCOL_H
+
+#include <cstring>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SERVERSOCKET "/tmp/proyecto.sock"   //default socket path of the server
+#define SERVERPATHSIZE 256                  //bytes for file paths inside requests
+
+/*request types*/
+enum{
+    REQ_LOAD = 1,       //load a PGM file (or reuse it if already resident), reply carries the memory fd
+    REQ_CREATE = 2,     //new black image of w x h, reply carries the memory fd
+    REQ_OPEN = 3,       //attach to a resident image by id, reply carries the memory fd
+    REQ_APPLY = 4,      //apply operation op_ID over the square x, y, w, h
+    REQ_UNDO = 5,       //undo last operation of the image
+    REQ_REDO = 6,       //redo last undone operation of the image
+    REQ_SAVE = 7,       //write the image as PGM to path
+    REQ_RELEASE = 8     //drop this client's reference to the image
+};
+
+/*reply status*/
+enum{
+    STATUS_OK = 0,
+    STATUS_BADREQUEST = -1,
+    STATUS_NOIMAGE = -2,
+    STATUS_IOERROR = -3,
+    STATUS_EMPTYSTACK = -4
+};
+
+struct processRequest{
+    uint32_t type;
+    uint32_t tag;                   //chosen by the client, returned in the reply
+    int32_t image;                  //image id on the server
+    int32_t op_ID;                  //operation identifier (see ImageProcess.h)
+    int32_t x, y, w, h;             //square to operate, or size for REQ_CREATE
+    double param[2];                //operation parameters
+    char path[SERVERPATHSIZE];      //file for REQ_LOAD and REQ_SAVE
+};
+
+struct processReply{
+    uint32_t type;
+    uint32_t tag;
+    int32_t status;
+    int32_t image;                  //image id on the server
+    int32_t width, height;          //image size
+    int32_t undoCount, redoCount;   //history of the image after the request
+};
+
+/*blocking client of the processing server*/
+class processClient{
+    private:
+        int fd;
+
+        /*send a request and wait its reply, receiving a descriptor if the server attached one*/
+        bool call(processRequest &request, processReply &reply, int *memoryFd){
+            static uint32_t nextTag = 1;
+            request.tag = nextTag++;
+            if(send(fd, &request, sizeof(request), 0) != sizeof(request))
+                return false;
+
+            char control[CMSG_SPACE(sizeof(int))];
+            struct iovec io = {&reply, sizeof(reply)};
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if(recvmsg(fd, &message, 0) != sizeof(reply))
+                return false;
+
+            struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+            if(header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS){
+                int received;
+                memcpy(&received, CMSG_DATA(header), sizeof(int));
+                if(memoryFd)
+                    *memoryFd = received;
+                else
+                    ::close(received);
+            }
+            return reply.tag == request.tag;
+        }
+
+        /*map the shared pixels of an image reply*/
+        unsigned char *map(processReply &reply, int memoryFd){
+            if(reply.status != STATUS_OK || memoryFd < 0)
+                return nullptr;
+            void *pixels = mmap(nullptr, (size_t)reply.width*reply.height, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, memoryFd, 0);
+            ::close(memoryFd);
+            return pixels == MAP_FAILED ? nullptr : (unsigned char*)pixels;
+        }
+
+        bool simple(uint32_t type, int image, processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = type;
+            request.image = image;
+            return call(request, reply, nullptr) && reply.status == STATUS_OK;
+        }
+
+    public:
+        processClient(){
+            fd = -1;
+        }
+
+        ~processClient(){
+            disconnect();
+        }
+
+        bool connect(const char *socketPath = SERVERSOCKET){
+            disconnect();
+            fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if(fd < 0)
+                return false;
+
+            struct sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+            if(::connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+                disconnect();
+                return false;
+            }
+            return true;
+        }
+
+        void disconnect(){
+            if(fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+
+        /*load (or reuse) a PGM on the server, returns its mapped pixels (unmap with munmap)*/
+        unsigned char *load(const char *path, processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = REQ_LOAD;
+            strncpy(request.path, path, SERVERPATHSIZE - 1);
+            int memoryFd = -1;
+            if(!call(request, reply, &memoryFd))
+                return nullptr;
+            return map(reply, memoryFd);
+        }
+
+        /*new black image on the server, returns its mapped pixels*/
+        unsigned char *create(int w, int h, processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = REQ_CREATE;
+            request.w = w;
+            request.h = h;
+            int memoryFd = -1;
+            if(!call(request, reply, &memoryFd))
+                return nullptr;
+            return map(reply, memoryFd);
+        }
+
+        /*attach to an image another client already holds*/
+        unsigned char *open(int image, processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = REQ_OPEN;
+            request.image = image;
+            int memoryFd = -1;
+            if(!call(request, reply, &memoryFd))
+                return nullptr;
+            return map(reply, memoryFd);
+        }
+
+        bool apply(int image, int op_ID, int x, int y, int w, int h, double param1, double param2,
+                    processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = REQ_APPLY;
+            request.image = image;
+            request.op_ID = op_ID;
+            request.x = x;
+            request.y = y;
+            request.w = w;
+            request.h = h;
+            request.param[0] = param1;
+            request.param[1] = param2;
+            return call(request, reply, nullptr) && reply.status == STATUS_OK;
+        }
+
+        bool undo(int image, processReply &reply){
+            return simple(REQ_UNDO, image, reply);
+        }
+
+        bool redo(int image, processReply &reply){
+            return simple(REQ_REDO, image, reply);
+        }
+
+        bool release(int image, processReply &reply){
+            return simple(REQ_RELEASE, image, reply);
+        }
+
+        bool save(int image, const char *path, processReply &reply){
+            processRequest request;
+            memset(&request, 0, sizeof(request));
+            request.type = REQ_SAVE;
+            request.image = image;
+            strncpy(request.path, path, SERVERPATHSIZE - 1);
+            return call(request, reply, nullptr) && reply.status == STATUS_OK;
+        }
+};
+
+#endif
@@ -0,0 +1,430 @@
+/* Servidor local de procesamiento de imagenes PGM:
+
+        -Mantiene las imagenes cargadas en memoria compartida (memfd), de modo
+        que los clientes leen y escriben los pixeles sin copias ni decodificacion.
+
+        -Aplica las mismas operaciones de ImageProcess que la interfaz, con
+        historial para deshacer y rehacer por imagen.
+
+        -Atiende a varios clientes por un socket local, tomando en lotes todas
+        las solicitudes disponibles antes de procesarlas agrupadas por imagen.
+
+    Uso:
+        $./proyecto_server [ruta del socket]
+    El protocolo y un cliente minimo se encuentran en ProcessProtocol.h.
+*/
+
+#include "ImageProcess.h"
+#include "ProcessProtocol.h"
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STACKSIZE 10        //Size of undo-redo operation stack of every image
+#define BATCHSIZE 256       //requests taken from the sockets before processing them
+
+volatile sig_atomic_t stopRequested = 0;   //set by SIGINT/SIGTERM
+
+void onStopSignal(int){
+    stopRequested = 1;
+}
+
+/*image kept in shared memory, clients map the same pages*/
+struct residentImage{
+    int fd;                             //memfd handed to the clients
+    unsigned char *pixels;              //server mapping of the image
+    int w, h;
+    std::string path;                   //file it was loaded from (empty for created images)
+    int holders;                        //client references
+    std::vector<ImageProcess> undo;     //operations to undo (last at the back)
+    std::vector<ImageProcess> redo;     //operations to redo (last at the back)
+};
+
+/*request read from a client, waiting in the current batch*/
+struct pendingRequest{
+    int client;
+    processRequest request;
+};
+
+class processServer{
+    private:
+        int listenFd;
+        std::string socketPath;
+        std::vector<struct pollfd> polls;           //listening socket first, then clients
+        std::map<int, residentImage> images;        //resident images by id
+        std::map<std::string, int> loaded;          //image id of every loaded path
+        std::map<int, std::map<int, int>> held;     //references of every client to every image
+        int nextImage;
+
+        int createImage(int w, int h);
+        void freeImage(int image);
+        void hold(int client, int image);
+        void release(int client, int image);
+        void dropClient(size_t index);
+        void fillReply(int image, processReply &reply);
+        int handle(pendingRequest &pending, processReply &reply);
+        void sendReply(int client, processReply &reply, int memoryFd);
+
+    public:
+        processServer(){
+            listenFd = -1;
+            nextImage = 1;
+        }
+
+        bool start(const char *path);
+        void run();
+        void stop();
+};
+
+/*listen on the local socket*/
+bool processServer::start(const char *path){
+    socketPath = path;
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenFd < 0)
+        return false;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+    if(bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0){
+        ::close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    struct pollfd entry = {listenFd, POLLIN, 0};
+    polls.push_back(entry);
+    return true;
+}
+
+/*close every connection and image*/
+void processServer::stop(){
+    for(size_t i = 1; i < polls.size(); i++)
+        ::close(polls[i].fd);
+    polls.clear();
+    while(!images.empty())
+        freeImage(images.begin()->first);
+    if(listenFd >= 0){
+        ::close(listenFd);
+        unlink(socketPath.c_str());
+    }
+    listenFd = -1;
+}
+
+/*shared memory image of w x h black pixels, returns its id or -1*/
+int processServer::createImage(int w, int h){
+    size_t bytes = (size_t)w*h;
+    int fd = memfd_create("proyecto-imagen", MFD_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, bytes) != 0){
+        if(fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    void *pixels = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(pixels == MAP_FAILED){
+        ::close(fd);
+        return -1;
+    }
+
+    int id = nextImage++;
+    residentImage &image = images[id];
+    image.fd = fd;
+    image.pixels = (unsigned char*)pixels;
+    image.w = w;
+    image.h = h;
+    image.holders = 0;
+    return id;
+}
+
+void processServer::freeImage(int id){
+    residentImage &image = images[id];
+    munmap(image.pixels, (size_t)image.w*image.h);
+    ::close(image.fd);
+    if(!image.path.empty())
+        loaded.erase(image.path);
+    images.erase(id);
+}
+
+void processServer::hold(int client, int id){
+    images[id].holders++;
+    held[client][id]++;
+}
+
+/*drop one reference, created images disappear with their last holder while loaded ones stay resident*/
+void processServer::release(int client, int id){
+    std::map<int, int> &references = held[client];
+    if(references[id] > 0 && --references[id] == 0)
+        references.erase(id);
+
+    residentImage &image = images[id];
+    if(--image.holders <= 0 && image.path.empty())
+        freeImage(id);
+}
+
+/*close a client releasing every image it held*/
+void processServer::dropClient(size_t index){
+    int client = polls[index].fd;
+    std::map<int, int> references = held[client];
+    for(std::map<int, int>::iterator it = references.begin(); it != references.end(); ++it){
+        for(int i = 0; i < it->second; i++)
+            release(client, it->first);
+    }
+    held.erase(client);
+    ::close(client);
+    polls.erase(polls.begin() + index);
+}
+
+void processServer::fillReply(int id, processReply &reply){
+    residentImage &image = images[id];
+    reply.image = id;
+    reply.width = image.w;
+    reply.height = image.h;
+    reply.undoCount = image.undo.size();
+    reply.redoCount = image.redo.size();
+}
+
+/*run one request, returns the memory descriptor to attach to the reply or -1*/
+int processServer::handle(pendingRequest &pending, processReply &reply){
+    processRequest &request = pending.request;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = request.type;
+    reply.tag = request.tag;
+    reply.status = STATUS_OK;
+    request.path[SERVERPATHSIZE-1] = '\0';
+
+    //requests creating or attaching images
+    if(request.type == REQ_LOAD){
+        int id;
+        std::map<std::string, int>::iterator found = loaded.find(request.path);
+        if(found != loaded.end()){
+            id = found->second;
+        }else{
+            pgmReader reader;
+            if(!reader.open(request.path)){
+                reply.status = STATUS_IOERROR;
+                return -1;
+            }
+            id = createImage(reader.width, reader.height);
+            if(id < 0 || !reader.readRows(images[id].pixels, reader.height)){
+                if(id >= 0)
+                    freeImage(id);
+                reply.status = STATUS_IOERROR;
+                return -1;
+            }
+            images[id].path = request.path;
+            loaded[request.path] = id;
+        }
+        hold(pending.client, id);
+        fillReply(id, reply);
+        return images[id].fd;
+    }
+
+    if(request.type == REQ_CREATE){
+        int id = request.w > 0 && request.h > 0 ? createImage(request.w, request.h) : -1;
+        if(id < 0){
+            reply.status = STATUS_BADREQUEST;
+            return -1;
+        }
+        hold(pending.client, id);
+        fillReply(id, reply);
+        return images[id].fd;
+    }
+
+    //requests over an existing image
+    if(images.find(request.image) == images.end()){
+        reply.status = STATUS_NOIMAGE;
+        return -1;
+    }
+    residentImage &image = images[request.image];
+    grayView view = {image.pixels, image.w, image.h, image.w, 1};
+
+    switch(request.type){
+        case REQ_OPEN:
+            hold(pending.client, request.image);
+            fillReply(request.image, reply);
+            return image.fd;
+
+        case REQ_APPLY:{
+            //shared images keep their size, resize is only available in the interface
+            if(request.op_ID < 0 || request.op_ID >= OP_COUNT || request.op_ID == OP_RESIZE ||
+                request.w <= 0 || request.h <= 0 ||
+                request.x < 0 || request.y < 0 || request.x >= image.w || request.y >= image.h ||
+                request.w > image.w - request.x || request.h > image.h - request.y){
+                reply.status = STATUS_BADREQUEST;
+                break;
+            }
+            ImageProcess img_op(view, request.op_ID, request.x, request.y, request.w, request.h,
+                                request.param[0], request.param[1]);
+            img_op.process();
+            img_op.setPatchImage(view, 1);
+
+            image.undo.push_back(img_op);
+            if(image.undo.size() > STACKSIZE)
+                image.undo.erase(image.undo.begin());
+            image.redo.clear();
+            break;
+        }
+
+        case REQ_UNDO:
+            if(image.undo.empty()){
+                reply.status = STATUS_EMPTYSTACK;
+                break;
+            }
+            image.undo.back().setPatchImage(view, 0);
+            image.redo.push_back(image.undo.back());
+            image.undo.pop_back();
+            break;
+
+        case REQ_REDO:
+            if(image.redo.empty()){
+                reply.status = STATUS_EMPTYSTACK;
+                break;
+            }
+            image.redo.back().setPatchImage(view, 1);
+            image.undo.push_back(image.redo.back());
+            image.redo.pop_back();
+            break;
+
+        case REQ_SAVE:
+            if(!writePGM(request.path, image.pixels, image.w, image.h))
+                reply.status = STATUS_IOERROR;
+            break;
+
+        case REQ_RELEASE:
+            if(held[pending.client][request.image] <= 0){
+                reply.status = STATUS_BADREQUEST;
+                break;
+            }
+            fillReply(request.image, reply);
+            release(pending.client, request.image);
+            return -1;
+
+        default:
+            reply.status = STATUS_BADREQUEST;
+    }
+
+    if(images.find(request.image) != images.end())
+        fillReply(request.image, reply);
+    return -1;
+}
+
+/*send a reply, passing the memory descriptor if there is one*/
+void processServer::sendReply(int client, processReply &reply, int memoryFd){
+    struct iovec io = {&reply, sizeof(reply)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if(memoryFd >= 0){
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &memoryFd, sizeof(int));
+    }
+    sendmsg(client, &message, MSG_NOSIGNAL);
+}
+
+/*wait for requests, take every available one and process them as a batch*/
+void processServer::run(){
+    std::vector<pendingRequest> batch;
+
+    while(!stopRequested){
+        if(poll(polls.data(), polls.size(), -1) < 0){
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+
+        //new clients
+        if(polls[0].revents & POLLIN){
+            int client;
+            while((client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+                struct pollfd entry = {client, POLLIN, 0};
+                polls.push_back(entry);
+            }
+        }
+
+        //read every request already waiting on every client
+        batch.clear();
+        for(size_t i = polls.size() - 1; i >= 1; i--){
+            if(!polls[i].revents)
+                continue;
+            bool closed = (polls[i].revents & (POLLHUP | POLLERR)) != 0;
+            while(batch.size() < BATCHSIZE){
+                pendingRequest pending;
+                pending.client = polls[i].fd;
+                ssize_t n = recv(pending.client, &pending.request, sizeof(processRequest), MSG_DONTWAIT);
+                if(n == sizeof(processRequest)){
+                    batch.push_back(pending);
+                }else{
+                    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                        closed = true;
+                    else if(n > 0)
+                        continue;   //malformed message, ignored
+                    break;
+                }
+            }
+            if(closed){
+                //requests of a closed client are not answered
+                int client = polls[i].fd;
+                batch.erase(std::remove_if(batch.begin(), batch.end(),
+                            [client](const pendingRequest &p){return p.client == client;}), batch.end());
+                dropClient(i);
+            }
+        }
+
+        //group work on the same image (order of each image is kept, new images go first)
+        std::stable_sort(batch.begin(), batch.end(), [](const pendingRequest &a, const pendingRequest &b){
+            int imageA = (a.request.type == REQ_LOAD || a.request.type == REQ_CREATE) ? -1 : a.request.image;
+            int imageB = (b.request.type == REQ_LOAD || b.request.type == REQ_CREATE) ? -1 : b.request.image;
+            return imageA < imageB;
+        });
+
+        for(size_t i = 0; i < batch.size(); i++){
+            processReply reply;
+            int memoryFd = handle(batch[i], reply);
+            sendReply(batch[i].client, reply, memoryFd);
+        }
+    }
+}
+
+int main(int argc, char **argv){
+    const char *path = argc > 1 ? argv[1] : SERVERSOCKET;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStopSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    processServer server;
+    if(!server.start(path)){
+        perror("No se pudo iniciar el servidor");
+        return 1;
+    }
+    printf("Servidor de procesamiento escuchando en %s\n", path);
+
+    server.run();
+    server.stop();
+    return 0;
+}
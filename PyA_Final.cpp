@@ -18,385 +18,766 @@
 #include "wx/wx.h"
 #include <wx/filedlg.h>
 #include "wx/sizer.h"
-#include "wx/rawbmp.h"
 #include "wx/splitter.h"
 #include "wx/spinctrl.h"
+#include "wx/notebook.h"
+#include <wx/numdlg.h>
+#include <wx/filename.h>
+#include "ImageProcess.h"
 #include <iostream>
 #include <ctime>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#define STACKSIZE 10                    //Size of undo-redo operation stack
+#define JOURNALFILE "proyecto.journal"  //append-only session journal used for crash recovery
+#define JOURNALBATCH 8                  //journal records written before forcing a sync to disk
+#define JOURNALSYNCMS 250               //idle time (ms) after which pending records are synced
+#define JOURNALVERSION 2                //layout of journal records (journals without a version are not replayed)
+#define CHECKPOINTSTEP 16               //journaled operations, undos and redos between full image checkpoints
+#define PROJECTTILE 64                  //tile side of the image stored in project files
+#define PROJECTVERSION 2                //layout of project files, files of another version are not opened
+#define LOADTICKMS 100                  //interval (ms) to show rows of an image being loaded
+#define MAXDOCUMENTS 16                 //images open at the same time, one notebook page each
+#define SLOTJOURNAL "proyecto.%d.journal" //session journal of every image after the first one
+#define SPILLFILE "proyecto.%d.spill"   //image and history of a page moved out of memory
+#define LOCKFILE "proyecto.lock"        //locked by the instance owning the journals and spill files of the directory
+#define PIDJOURNAL "proyecto.%ld.%d.journal" //journal of a page when another instance holds the lock
+#define PIDSPILL "proyecto.%ld.%d.spill" //spill file of a page when another instance holds the lock
+#define MEMORYBUDGET 512                //default memory (MB) for images, histories and displays of all pages
+
+/*gray view over the RGB pixels of a wxImage*/
+grayView viewOf(wxImage &image){
+    grayView view = {image.GetData(), image.GetWidth(), image.GetHeight(), image.GetWidth(), 3};
+    return view;
+}
+
+/*copy one channel of an image area into a gray buffer (all channels hold the same value)*/
+void getGrayRect(wxImage &image, int x, int y, int w, int h, unsigned char *gray){
+    getGrayRect(viewOf(image),x,y,w,h,gray);
+}
 
-#define STACKSIZE 10    //Size of undo-redo operation stack
+/*write a gray buffer over an image area in place*/
+void setGrayRect(wxImage &image, int x, int y, int w, int h, const unsigned char *gray){
+    setGrayRect(viewOf(image),x,y,w,h,gray);
+}
 
-/*operations applied to image patches*/
-class ImageProcess{
+/*stack of operations applied to the original image*/
+class operationStack{
     private:
-        wxBitmap patch;     //filtered image area
-        wxBitmap old_patch; //pre-filtered image area
-        int op_ID;          //index of operation applied
-        int x, y;           //patch upperleft corner coordinate
-        int w, h;           //patch size
-        bool empty;         //verify if patch is allocated
+        ImageProcess stack[STACKSIZE];
+        int top;
+
+        /*eliminate first element from the stack to push another*/
+        void freeStackOverflow(){
+            ImageProcess aux;
+            for(int i = 0; i < STACKSIZE-1; i++){
+                stack[i] = stack[i+1];
+            }
+            stack[STACKSIZE-1] = ImageProcess();
+            top--;
+        }
 
     public:
-        //constructors
-        ImageProcess(){
-            empty = true;
+        operationStack(){
+            top = -1;
+            for(int i = 0; i < STACKSIZE; i++){
+                stack[i] = ImageProcess();
+            }
         }
 
-        ImageProcess(wxImage &image, int operation, int x_coord, int y_coord, int width,int height){
-            patch = image.GetSubImage(wxRect(x_coord,y_coord,width,height));
-            //copy bitmap
-            old_patch = patch.GetSubBitmap(wxRect(0, 0, patch.GetWidth(), patch.GetHeight()));
-            op_ID = operation; 
-            w = width;
-            h = height;
-            x = x_coord;
-            y = y_coord;
-            empty = false;
+        int getElements(){
+            return top+1;
         }
 
-        //getters
-        bool getPatchState(){
-            return empty;
+        /*get element i counting from the bottom without removing it*/
+        ImageProcess peek(int i){
+            if(i < 0 || i > top){
+                return ImageProcess();
+            }
+            return stack[i];
         }
 
-        int getOpID(){
-            return op_ID;
+        void clearStack(){
+            //release patches so their buffers return to the pool
+            for(int i = 0; i <= top; i++){
+                stack[i] = ImageProcess();
+            }
+            top = -1;
         }
 
-        int getX(){
-            return x;
+        /*Insert image operation into the stack*/
+        void push(ImageProcess data){
+            //verify full stack
+            if(top == STACKSIZE-1){
+                printf("La pila se encuentra llena\n");
+                freeStackOverflow();
+            }
+
+            //update top 
+            top++;
+            //insert data at the top
+            stack[top] = data;
+   
         }
 
-        int getY(){
-            return y;
+        /*get image operation from the top*/
+        ImageProcess pop(){
+            //verify empty stack
+            if(top == -1){
+                return ImageProcess();
+            }
+
+            //get data from the stack
+            ImageProcess topData = stack[top];
+            stack[top] = ImageProcess();
+            //update top 
+            top--;
+
+            return topData;
         }
 
-        int getWidth(){
-            return w;
+};
+
+/*append-only journal of the session (checkpoints and operations) to recover it after a crash*/
+class sessionJournal{
+    public:
+        //record types stored in the journal
+        enum{REC_CHECKPOINT = 1, REC_APPLY = 2, REC_UNDO = 3, REC_REDO = 4, REC_MASKAPPLY = 5,
+                REC_MASKUNDO = 6, REC_MASKREDO = 7};
+
+        //decoded record read back from the journal
+        struct record{
+            int type;
+            std::vector<unsigned char> payload;
+        };
+
+        //payload of an applied operation
+        struct opRecord{
+            int32_t op_ID;
+            int32_t x, y, w, h;
+            double param[2];
+        };
+
+    private:
+        //header written before every payload
+        struct recordHeader{
+            uint32_t magic;
+            uint32_t version;   //JOURNALVERSION, records of another layout end the journal
+            uint32_t type;
+            uint32_t length;
+            uint32_t checksum;
+        };
+        static constexpr uint32_t MAGIC = 0x4a417950;   //"PyAJ"
+
+        std::string path;                               //journal file path
+        int fd;                                         //journal file descriptor (only used by the writer)
+        bool running;                                   //writer thread state
+        std::vector<std::vector<unsigned char>> queue;  //encoded records waiting for the writer (checksum unset)
+        std::mutex lock;                                //guards queue and running
+        std::condition_variable pending;                //wakes the writer when records arrive
+        std::thread writer;                             //background thread writing and syncing records
+
+        static uint32_t checksum(const unsigned char *data, size_t length);
+        static bool writeAll(int file, const unsigned char *data, size_t length);
+        static std::vector<unsigned char> startRecord(int type, const unsigned char *head, size_t headLength,
+                                                        size_t dataLength);
+        void push(std::vector<unsigned char> &&rec);
+        void enqueue(int type, const unsigned char *head, size_t headLength,
+                        const unsigned char *data, size_t dataLength);
+        void writeCheckpoint(const std::vector<unsigned char> &rec);
+        void writerLoop();
+
+    public:
+        sessionJournal(){
+            fd = -1;
+            running = false;
         }
 
-        int getHeight(){
-            return h;
+        ~sessionJournal(){
+            close();
         }
 
+        bool isOpen(){
+            return running;
+        }
 
-        //image processing methods
-        wxBitmap setPatchImage(wxImage &image, int patch_mode);
-        wxBitmap gauss_filter(wxImage &image);
-        wxBitmap sobel_filter(wxImage &image);
-        wxBitmap constrast(wxImage &image,double alpha, int beta);
-        wxBitmap negative(wxImage &image);
-        wxBitmap setOldPatchImage(wxImage &image);
+        bool open(const char *file, bool keep);
+        void close();
+        void checkpoint(grayView image);
+        void logApply(int operation, const int *square, double param1, double param2,
+                        const spanMask *selection = nullptr);
+        void logPatch(int type, int x, int y, int w, int h, const unsigned char *gray);
+        void logMaskPatch(int type, const spanMask &selection, const unsigned char *gray);
+        static bool readSpans(const unsigned char *data, size_t count, spanMask &selection);
+        static bool load(const char *file, std::vector<record> &records);
 };
 
-///////////////////////////////////////////////////////////////////////Filtering Methods
+/*FNV-1a hash used to detect torn or corrupted records*/
+uint32_t sessionJournal::checksum(const unsigned char *data, size_t length){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
 
-wxBitmap ImageProcess::setPatchImage(wxImage &image, int patch_mode){
-    //turn image into bitmap to handle pixels
-    wxBitmap m_bitmap = wxBitmap(image);
-    wxNativePixelData imageData(m_bitmap);
-    if ( !imageData ){
-        wxLogError("Error al generar mapa de bits");
-        return m_bitmap.ConvertToImage();
+/*write the whole buffer retrying on partial writes*/
+bool sessionJournal::writeAll(int file, const unsigned char *data, size_t length){
+    while(length > 0){
+        ssize_t written = write(file, data, length);
+        if(written < 0)
+            return false;
+        data += written;
+        length -= written;
     }
+    return true;
+}
 
-    //turn patch into nativepixel object to handle pixels
-    wxNativePixelData *patchData;
-    if(patch_mode)
-        patchData = new wxNativePixelData(patch);
-    else
-        patchData = new wxNativePixelData(old_patch);
-    if ( !patchData ){
-        wxLogError("Error al generar mapa de bits");
-        return m_bitmap.ConvertToImage();
+/*open the journal and start the writer thread (keep=false discards the previous session)*/
+bool sessionJournal::open(const char *file, bool keep){
+    close();
+    path = file;
+    fd = ::open(file, O_WRONLY | O_CREAT | O_APPEND | (keep ? 0 : O_TRUNC), 0644);
+    if(fd < 0){
+        wxLogError("No se pudo abrir el registro de sesion");
+        return false;
     }
 
-    //iterate over every pixel in the patch
-    wxNativePixelData::Iterator pImage(imageData);
-    wxNativePixelData::Iterator pPatch(*patchData);
+    running = true;
+    writer = std::thread(&sessionJournal::writerLoop, this);
+    return true;
+}
+
+/*stop the writer after every queued record has been written and synced*/
+void sessionJournal::close(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!running)
+            return;
+        running = false;
+    }
+    pending.notify_one();
+    writer.join();
+    ::close(fd);
+    fd = -1;
+}
 
-    pImage.MoveTo(imageData,x,y);
-    for ( int y = 0; y < h; ++y ){
-        wxNativePixelData::Iterator image_rowStart = pImage;
-        wxNativePixelData::Iterator patch_rowStart = pPatch;
+/*record with its header and head written, dataLength bytes are left for the caller after the head
+  (the checksum is computed by the writer thread)*/
+std::vector<unsigned char> sessionJournal::startRecord(int type, const unsigned char *head, size_t headLength,
+                                                        size_t dataLength){
+    std::vector<unsigned char> rec(sizeof(recordHeader) + headLength + dataLength);
+    recordHeader header = {MAGIC, JOURNALVERSION, (uint32_t)type, (uint32_t)(headLength + dataLength), 0};
+    memcpy(rec.data(), &header, sizeof(recordHeader));
+    memcpy(rec.data() + sizeof(recordHeader), head, headLength);
+    return rec;
+}
 
-        for ( int x = 0; x < w; ++x ){
-            //printf("[%d,%d] image: %d, patch: %d\n",y,x,pImage.Red(),pPatch.Red());
-            //set value of the patch into whole image
-            pImage.Red() = pImage.Green() = pImage.Blue() = pPatch.Red();
+/*hand a record to the writer thread (the caller never touches the disk)*/
+void sessionJournal::push(std::vector<unsigned char> &&rec){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(std::move(rec));
+    }
+    pending.notify_one();
+}
 
-            ++pImage; // advance to next pixel to the Right
-            ++pPatch; 
-        }
+/*encode a record from a head and a data buffer*/
+void sessionJournal::enqueue(int type, const unsigned char *head, size_t headLength,
+                                const unsigned char *data, size_t dataLength){
+    if(!running)
+        return;
 
-        pImage = image_rowStart;
-        pPatch = patch_rowStart;
-        pImage.OffsetY(imageData, 1);
-        pPatch.OffsetY(*patchData, 1);
-    }
-
-    delete patchData;
-    return m_bitmap;
-}
-
-
-/*Apply gaussian filter for smoother image*/
-wxBitmap ImageProcess::gauss_filter(wxImage &image){
-    //Gauss Kernel 5x5 window
-    int kernel[5][5] = {{1,4,7,4,1},
-                        {4,16,26,16,4},
-                        {7,26,41,26,7},
-                        {4,16,26,16,4},
-                        {1,4,7,4,1}};
-    int f_rows = 5,f_cols = 5;
-    //filter matrix center
-    int center_i = f_rows/2;
-    int center_j = f_cols/2;
-
-    //window mutiply accumulator and division coefficient
-    int aux;
-    int div_c = 0;
-
-    //calculate division coeficient
-    for(int i= 0; i < f_rows*f_cols; i++){
-        div_c += *(kernel[0] + i);
-    }
-
-    //turn patch image into bitmap to handle pixels
-    wxNativePixelData data_filter(patch);
-    wxNativePixelData data_original(old_patch);
-    if ( !data_filter |  !data_original){
-        wxLogError("Failed to gain raw access to bitmap data");
-        return image;
-    }
-
-
-    //iterator over patches pixels
-    wxNativePixelData::Iterator p_filter(data_filter);
-    wxNativePixelData::Iterator p_original(data_original);
-    for ( int y = 0; y < h; y++ ){
-        wxNativePixelData::Iterator filter_rowStart = p_filter;
-        for ( int x = 0; x < w; x++ ){
-            //reset Channel values
-            aux = 0;
-
-            //filter window coordinates
-            p_original.MoveTo(data_original,x-center_j,y-center_i);
-            for(int i = y-center_i; i <= y+center_i; i++){
-                wxNativePixelData::Iterator original_rowStart = p_original;
-                for(int j = x-center_j; j <= x+center_j; j++){
-                    
-                    //exclude non fitting filter pixels
-                    if((i<0) || (j<0) || (i>=h) || (j>=w)){
-                        break;
-                    }
-                    
-                    //take any of the color channel value
-                    aux += p_original.Red() * kernel[center_i-(y-i)][center_j-(x-j)];
-
-                    ++p_original; // advance to next pixel to the right
-                }
-                p_original = original_rowStart;
-                p_original.OffsetY(data_original, 1);
-            }
+    std::vector<unsigned char> rec = startRecord(type, head, headLength, dataLength);
+    if(dataLength)
+        memcpy(rec.data() + sizeof(recordHeader) + headLength, data, dataLength);
+    push(std::move(rec));
+}
 
-            p_filter.Red() = p_filter.Green() = p_filter.Blue() = aux / div_c;
-            ++p_filter; // advance to next pixel to the right
-        }
-        p_filter = filter_rowStart;
-        p_filter.OffsetY(data_filter, 1);
-    }
-    
-    return  setPatchImage(image,1);
-}
-
-/*Apply Sobel filter for border detection */
-wxBitmap ImageProcess::sobel_filter(wxImage &image){
-    //Sobel kernel
-    int sx[3][3] = { {-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1} };
-    int sy[3][3] = { {1, 2, 1}, {0, 0, 0}, {-1, -2, -1} };
-    //kernel center
-    int center_i = 1;
-    int center_j = 1;
-
-    //window mutiply accumulator
-    int aux_gx, aux_gy, res;
-
-    //turn patch image into bitmap to handle pixels
-    wxNativePixelData data_filter(patch);
-    wxNativePixelData data_original(old_patch);
-    if ( !data_filter |  !data_original){
-        wxLogError("Error al generar mapa de bits");
-        return image;
-    }
-
-    //iterator over patches pixels
-    wxNativePixelData::Iterator p_filter(data_filter);
-    wxNativePixelData::Iterator p_original(data_original);
-    //center pixel of image
-    for(int y = 0; y < h; y++){
-        wxNativePixelData::Iterator filter_rowStart = p_filter;
-        for(int x = 0; x < w; x++){
-            aux_gx = 0;
-            aux_gy = 0;
-
-            //filter window coordinates
-            p_original.MoveTo(data_original,x-center_j,y-center_i);
-            for(int i= y-center_i; i <= y+center_i; i++){
-                wxNativePixelData::Iterator original_rowStart = p_original;
-                for(int j = x-center_j; j <= x+center_j; j++){
-                    //exclude non fitting filter pixels
-                    if((i<0) || (j<0) || (i>=h) || (j>=w)){
-                        break;
-                    }
-                    
-                    //take any of the color channel value
-                    aux_gx += p_original.Red() * sx[center_i-(y-i)][center_j-(x-j)];
-                    aux_gy += p_original.Red() * sy[center_i-(y-i)][center_j-(x-j)];
-
-                    ++p_original; // advance to next pixel to the right
-                }
-                p_original = original_rowStart;
-                p_original.OffsetY(data_original, 1);
-            }
+/*full image snapshot, replay always starts from the latest one (pixels go straight into the record)*/
+void sessionJournal::checkpoint(grayView image){
+    if(!running)
+        return;
 
-            res = (unsigned char)(sqrt(aux_gx*aux_gx + aux_gy*aux_gy));
-            p_filter.Red() = p_filter.Green() = p_filter.Blue() = res;
+    int32_t size[2] = {image.width, image.height};
+    std::vector<unsigned char> rec = startRecord(REC_CHECKPOINT, (unsigned char*)size, sizeof(size),
+                                                    (size_t)image.width*image.height);
+    getGrayRect(image, 0, 0, image.width, image.height, rec.data() + sizeof(recordHeader) + sizeof(size));
+    push(std::move(rec));
+}
 
-            ++p_filter; // advance to next pixel to the right
-        }
-        p_filter = filter_rowStart;
-        p_filter.OffsetY(data_filter, 1);
+/*operation applied by the user, replayed by running it again*/
+void sessionJournal::logApply(int operation, const int *square, double param1, double param2,
+                                const spanMask *selection){
+    opRecord op = {operation, square[0], square[1], square[2], square[3], {param1, param2}};
+    if(!selection){
+        enqueue(REC_APPLY, (unsigned char*)&op, sizeof(op), nullptr, 0);
+        return;
     }
 
-    return setPatchImage(image,1);
+    //operation over a selection: its bounding box followed by its spans
+    op.x = selection->getLeft();
+    op.y = selection->getTop();
+    op.w = selection->getWidth();
+    op.h = selection->getHeight();
+    const std::vector<spanMask::span> &spans = selection->getSpans();
+    enqueue(REC_MASKAPPLY, (unsigned char*)&op, sizeof(op), (const unsigned char*)spans.data(),
+            spans.size()*sizeof(spanMask::span));
 }
 
-/*Change constrast factor (alpha) and ilumination (beta) */
-wxBitmap ImageProcess::constrast(wxImage &image,double alpha, int beta){
-    //turn patch image into bitmap to handle pixels
-    wxNativePixelData data_filter(patch);
+/*pixels written back by undo/redo, replayed by copying them over the image*/
+void sessionJournal::logPatch(int type, int x, int y, int w, int h, const unsigned char *gray){
+    int32_t rect[4] = {x, y, w, h};
+    enqueue(type, (unsigned char*)rect, sizeof(rect), gray, (size_t)w*h);
+}
+
+/*selected pixels written back by undo/redo of an operation over a selection: span count, spans and pixels*/
+void sessionJournal::logMaskPatch(int type, const spanMask &selection, const unsigned char *gray){
+    const std::vector<spanMask::span> &spans = selection.getSpans();
+    int32_t count = spans.size();
+    std::vector<unsigned char> head(sizeof(count) + spans.size()*sizeof(spanMask::span));
+    memcpy(head.data(), &count, sizeof(count));
+    memcpy(head.data() + sizeof(count), spans.data(), spans.size()*sizeof(spanMask::span));
+    enqueue(type, head.data(), head.size(), gray, selection.area());
+}
 
-    if ( !data_filter ){
-        wxLogError("Error al generar mapa de bits");
-        return image;
+/*rebuild a selection from spans stored in a record*/
+bool sessionJournal::readSpans(const unsigned char *data, size_t count, spanMask &selection){
+    for(size_t k = 0; k < count; k++){
+        spanMask::span run;
+        memcpy(&run, data + k*sizeof(run), sizeof(run));
+        if(!selection.add(run.y, run.x, run.length))
+            return false;
     }
+    return !selection.isEmpty();
+}
 
-    //iterator over patches pixels
-    wxNativePixelData::Iterator p_filter(data_filter);
+/*a checkpoint makes older records useless, so it starts a new journal file atomically*/
+void sessionJournal::writeCheckpoint(const std::vector<unsigned char> &rec){
+    std::string tmpPath = path + ".tmp";
+    int tmp = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(tmp < 0 || !writeAll(tmp, rec.data(), rec.size()) || fdatasync(tmp) != 0
+        || rename(tmpPath.c_str(), path.c_str()) != 0){
+        //fall back to appending the checkpoint to the current journal
+        if(tmp >= 0)
+            ::close(tmp);
+        writeAll(fd, rec.data(), rec.size());
+        fdatasync(fd);
+        return;
+    }
 
-    //center pixel of image
-    for(int y = 0; y < h; y++){
-        wxNativePixelData::Iterator filter_rowStart = p_filter;
-        for(int x = 0; x < w; x++){
-                    
-            //Change all channels at once using one as reference
-            p_filter.Red() = p_filter.Green() = p_filter.Blue() = (int)(p_filter.Red() * alpha) + beta;
-            //8 bit limit (value clipping)
-            if(p_filter.Red() > 255){
-                p_filter.Red() = p_filter.Green() = p_filter.Blue() = 255;
-            }
-            ++p_filter; // advance to next pixel to the right
-        }
-        p_filter = filter_rowStart;
-        p_filter.OffsetY(data_filter, 1);
+    //make the rename durable before dropping the old journal
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dirFd = ::open(dir.c_str(), O_RDONLY);
+    if(dirFd >= 0){
+        fsync(dirFd);
+        ::close(dirFd);
     }
 
-    return setPatchImage(image,1);
+    ::close(fd);
+    fd = tmp;
 }
 
-/*Change values to their difference from the max value (255) */
-wxBitmap ImageProcess::negative(wxImage &image){
-    //turn patch image into bitmap to handle pixels
-    wxNativePixelData data_filter(patch);
+/*writer thread: writes records in arrival order and syncs them in batches*/
+void sessionJournal::writerLoop(){
+    std::vector<std::vector<unsigned char>> batch;
+    int unsynced = 0;
+
+    std::unique_lock<std::mutex> guard(lock);
+    while(running || !queue.empty()){
+        if(queue.empty()){
+            if(unsynced == 0){
+                pending.wait(guard);
+            }else if(!pending.wait_for(guard, std::chrono::milliseconds(JOURNALSYNCMS),
+                                        [this]{return !queue.empty() || !running;})){
+                //journal went idle, sync what has been written so far
+                guard.unlock();
+                fdatasync(fd);
+                guard.lock();
+                unsynced = 0;
+            }
+            continue;
+        }
+
+        batch.swap(queue);
+        guard.unlock();
+
+        for(size_t i = 0; i < batch.size(); i++){
+            recordHeader header;
+            memcpy(&header, batch[i].data(), sizeof(recordHeader));
+            header.checksum = checksum(batch[i].data() + sizeof(recordHeader), header.length);
+            memcpy(batch[i].data(), &header, sizeof(recordHeader));
+            if(header.type == REC_CHECKPOINT){
+                writeCheckpoint(batch[i]);
+                unsynced = 0;
+            }else{
+                writeAll(fd, batch[i].data(), batch[i].size());
+                unsynced++;
+            }
+        }
+        batch.clear();
 
-    if ( !data_filter ){
-        wxLogError("Error al generar mapa de bits");
-        return image;
+        if(unsynced >= JOURNALBATCH){
+            fdatasync(fd);
+            unsynced = 0;
+        }
+        guard.lock();
     }
 
-    //iterator over patches pixels
-    wxNativePixelData::Iterator p_filter(data_filter);
+    if(unsynced > 0)
+        fdatasync(fd);
+}
+
+/*read the records starting at the latest checkpoint, dropping a torn tail left by a crash*/
+bool sessionJournal::load(const char *file, std::vector<record> &records){
+    records.clear();
+    int in = ::open(file, O_RDWR);
+    if(in < 0)
+        return false;
+
+    std::vector<unsigned char> data;
+    unsigned char buffer[65536];
+    ssize_t n;
+    while((n = read(in, buffer, sizeof(buffer))) > 0){
+        data.insert(data.end(), buffer, buffer + n);
+    }
 
-    //center pixel of image
-    for(int y = 0; y < h; y++){
-        wxNativePixelData::Iterator filter_rowStart = p_filter;
-        for(int x = 0; x < w; x++){
-                    
-            //Change all channels at once using complement of any of them
-            p_filter.Red() = p_filter.Green() = p_filter.Blue() = 255 ^ p_filter.Red();
-            ++p_filter; // advance to next pixel to the right
+    size_t offset = 0;
+    while(offset + sizeof(recordHeader) <= data.size()){
+        recordHeader header;
+        memcpy(&header, data.data() + offset, sizeof(recordHeader));
+        const unsigned char *payload = data.data() + offset + sizeof(recordHeader);
+        if(header.magic != MAGIC || header.version != JOURNALVERSION || header.length > data.size() - offset - sizeof(recordHeader)
+            || checksum(payload, header.length) != header.checksum){
+            break;
         }
-        p_filter = filter_rowStart;
-        p_filter.OffsetY(data_filter, 1);
+
+        //everything before a checkpoint is already contained in it
+        if(header.type == REC_CHECKPOINT)
+            records.clear();
+        record rec;
+        rec.type = header.type;
+        rec.payload.assign(payload, payload + header.length);
+        records.push_back(std::move(rec));
+
+        offset += sizeof(recordHeader) + header.length;
     }
 
-    return setPatchImage(image,1);
+    //cut incomplete records so new ones are appended after valid data
+    if(offset < data.size() && ftruncate(in, offset) != 0)
+        wxLogError("No se pudo reparar el registro de sesion");
+    ::close(in);
+
+    return !records.empty() && records[0].type == REC_CHECKPOINT;
 }
 
+/*binary project bundling original image, tiled current image and operation history.
+  Every section is aligned so the file can be mapped and read lazily:
 
-/*stack of operations applied to the original image*/
-class operationStack{
+    header | source path | original image (rows) | current image (tiles) | history index | history patches
+*/
+class projectFile{
     private:
-        ImageProcess stack[STACKSIZE];
-        int top;
+        struct header{
+            char magic[8];              //"PYAPROJ1"
+            uint32_t version;
+            uint32_t width, height;     //image size
+            uint32_t tileSize;          //side of the square tiles of the current image
+            uint32_t tilesX, tilesY;    //tiles per row and column
+            uint32_t undoCount;         //history entries in the undo stack (bottom first)
+            uint32_t redoCount;         //history entries in the redo stack (bottom first)
+            uint32_t sourceLength;      //bytes of the source path
+            uint64_t sourceOffset;
+            uint64_t originalOffset;
+            uint64_t tilesOffset;
+            uint64_t historyOffset;
+            uint64_t fileSize;
+        };
+
+        //history index entry, patches are stored row by row. An operation over a selection keeps
+        //only the selected pixels, its spans are stored at patchOffset before the filtered pixels
+        struct historyEntry{
+            int32_t op_ID;
+            int32_t x, y, w, h;
+            int32_t spans;              //spans of the selection (0 for a rectangle)
+            double param[2];            //operation parameters
+            uint64_t patchOffset;       //filtered area
+            uint64_t oldOffset;         //pre-filtered area
+        };
+
+        static uint64_t align(uint64_t offset, uint64_t boundary){
+            return (offset + boundary - 1) & ~(boundary - 1);
+        }
 
-        /*eliminate first element from the stack to push another*/
-        void freeStackOverflow(){
-            ImageProcess aux;
-            for(int i = 0; i < STACKSIZE-1; i++){
-                stack[i] = stack[i+1];
-            }
-            top--;
+        static bool writeAt(FILE *out, uint64_t offset, const void *data, size_t length);
+
+        /*filtered pixels of an entry, after the spans of its selection if it has one*/
+        static uint64_t filteredOffset(const historyEntry &entry){
+            if(entry.spans <= 0)
+                return entry.patchOffset;
+            return align(entry.patchOffset + (uint64_t)entry.spans*sizeof(spanMask::span), 64);
         }
 
     public:
-        operationStack(){
-            top = -1;
-            for(int i = 0; i < STACKSIZE; i++){
-                stack[i] = ImageProcess();
-            }
-        }
+        static bool save(const char *file, wxImage &image, const patchBuffer &original, const wxString &source,
+                            operationStack &undoStack, operationStack &redoStack);
+        static bool open(const char *file, wxImage &image, patchBuffer &original, wxString &source,
+                            std::vector<ImageProcess> &undoItems, std::vector<ImageProcess> &redoItems);
+};
 
-        int getElements(){
-            return top+1;
-        }
+/*write data at its section offset, zero filling the alignment gap*/
+bool projectFile::writeAt(FILE *out, uint64_t offset, const void *data, size_t length){
+    long position = ftell(out);
+    if(position < 0 || (uint64_t)position > offset)
+        return false;
+    for(; (uint64_t)position < offset; position++)
+        fputc(0, out);
+    return length == 0 || fwrite(data, 1, length, out) == length;
+}
 
-        void clearStack(){
-            top = -1;
+/*save image, original and history as a project*/
+bool projectFile::save(const char *file, wxImage &image, const patchBuffer &original, const wxString &source,
+                        operationStack &undoStack, operationStack &redoStack){
+    int w = image.GetWidth();
+    int h = image.GetHeight();
+    int tile = PROJECTTILE;
+
+    header head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, "PYAPROJ1", 8);
+    head.version = PROJECTVERSION;
+    head.width = w;
+    head.height = h;
+    head.tileSize = tile;
+    head.tilesX = (w + tile - 1) / tile;
+    head.tilesY = (h + tile - 1) / tile;
+    head.undoCount = undoStack.getElements();
+    head.redoCount = redoStack.getElements();
+    head.sourceLength = strlen(source.utf8_str());
+
+    //section layout
+    size_t tileBytes = (size_t)tile*tile;
+    head.sourceOffset = sizeof(header);
+    head.originalOffset = align(head.sourceOffset + head.sourceLength, 4096);
+    head.tilesOffset = align(head.originalOffset + (uint64_t)w*h, 4096);
+    head.historyOffset = align(head.tilesOffset + (uint64_t)head.tilesX*head.tilesY*tileBytes, 4096);
+
+    std::vector<ImageProcess> items;
+    for(int i = 0; i < undoStack.getElements(); i++)
+        items.push_back(undoStack.peek(i));
+    for(int i = 0; i < redoStack.getElements(); i++)
+        items.push_back(redoStack.peek(i));
+
+    std::vector<historyEntry> index(items.size());
+    uint64_t offset = align(head.historyOffset + index.size()*sizeof(historyEntry), 64);
+    for(size_t i = 0; i < items.size(); i++){
+        size_t bytes = items[i].getPatchSize(1);
+        size_t oldBytes = items[i].getPatchSize(0);
+        size_t spanBytes = items[i].isMasked() ? items[i].getMask()->getSpans().size()*sizeof(spanMask::span) : 0;
+        index[i].op_ID = items[i].getOpID();
+        index[i].x = items[i].getX();
+        index[i].y = items[i].getY();
+        index[i].w = items[i].getWidth();
+        index[i].h = items[i].getHeight();
+        index[i].spans = spanBytes / sizeof(spanMask::span);
+        index[i].param[0] = items[i].getParam(0);
+        index[i].param[1] = items[i].getParam(1);
+        index[i].patchOffset = offset;
+        index[i].oldOffset = align(filteredOffset(index[i]) + bytes, 64);
+        offset = align(index[i].oldOffset + oldBytes, 64);
+    }
+    head.fileSize = offset;
+
+    //written aside and renamed, history views mapped from a previous version of the file stay valid
+    std::string temporary = std::string(file) + ".tmp";
+    FILE *out = fopen(temporary.c_str(), "wb");
+    if(!out)
+        return false;
+
+    bool ok = writeAt(out, 0, &head, sizeof(head)) &&
+                writeAt(out, head.sourceOffset, source.utf8_str(), head.sourceLength);
+
+    //original image
+    std::vector<unsigned char> gray((size_t)w*h);
+    if(!original.isNull() && original.size() == gray.size())
+        memcpy(gray.data(), original.data(), gray.size());
+    else
+        getGrayRect(image, 0, 0, w, h, gray.data());
+    ok = ok && writeAt(out, head.originalOffset, gray.data(), gray.size());
+
+    //current image cut in tiles (border tiles are padded to full size)
+    getGrayRect(image, 0, 0, w, h, gray.data());
+    std::vector<unsigned char> tileData(tileBytes);
+    for(uint32_t ty = 0; ok && ty < head.tilesY; ty++){
+        for(uint32_t tx = 0; ok && tx < head.tilesX; tx++){
+            std::fill(tileData.begin(), tileData.end(), 0);
+            int tw = std::min(tile, w - (int)tx*tile);
+            int th = std::min(tile, h - (int)ty*tile);
+            for(int i = 0; i < th; i++)
+                memcpy(&tileData[(size_t)i*tile], &gray[((size_t)ty*tile + i)*w + tx*tile], tw);
+            ok = writeAt(out, head.tilesOffset + ((uint64_t)ty*head.tilesX + tx)*tileBytes, tileData.data(), tileBytes);
         }
+    }
 
-        /*Insert image operation into the stack*/
-        void push(ImageProcess data){
-            //verify full stack
-            if(top == STACKSIZE-1){
-                printf("La pila se encuentra llena\n");
-                freeStackOverflow();
-            }
+    //history index and patches
+    ok = ok && writeAt(out, head.historyOffset, index.data(), index.size()*sizeof(historyEntry));
+    for(size_t i = 0; ok && i < items.size(); i++){
+        if(index[i].spans > 0)
+            ok = writeAt(out, index[i].patchOffset, items[i].getMask()->getSpans().data(),
+                            index[i].spans*sizeof(spanMask::span));
+        ok = ok && writeAt(out, filteredOffset(index[i]), items[i].getPatchData(1), items[i].getPatchSize(1)) &&
+                writeAt(out, index[i].oldOffset, items[i].getPatchData(0), items[i].getPatchSize(0));
+    }
+    ok = ok && writeAt(out, head.fileSize, nullptr, 0);
 
-            //update top 
-            top++;
-            //insert data at the top
-            stack[top] = data;
-   
+    ok = (fclose(out) == 0) && ok && rename(temporary.c_str(), file) == 0;
+    if(!ok)
+        unlink(temporary.c_str());
+    return ok;
+}
+
+/*map a project, history patches and the original image stay in the file until they are used*/
+bool projectFile::open(const char *file, wxImage &image, patchBuffer &original, wxString &source,
+                        std::vector<ImageProcess> &undoItems, std::vector<ImageProcess> &redoItems){
+    int fd = ::open(file, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header)){
+        ::close(fd);
+        return false;
+    }
+
+    //private writable mapping: pages are shared with the page cache and never written back
+    void *mem = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mem == MAP_FAILED)
+        return false;
+    std::shared_ptr<mappedFile> mapping = std::make_shared<mappedFile>((unsigned char*)mem, info.st_size);
+
+    //validate header against the real file size
+    header head;
+    memcpy(&head, mapping->data, sizeof(head));
+    size_t tileBytes = (size_t)head.tileSize*head.tileSize;
+    if(memcmp(head.magic, "PYAPROJ1", 8) != 0 || head.version != PROJECTVERSION || head.fileSize > mapping->size ||
+        head.width == 0 || head.height == 0 || head.tileSize == 0 ||
+        head.tilesX != (head.width + head.tileSize - 1) / head.tileSize ||
+        head.tilesY != (head.height + head.tileSize - 1) / head.tileSize ||
+        head.sourceOffset + head.sourceLength > head.fileSize ||
+        head.originalOffset + (uint64_t)head.width*head.height > head.fileSize ||
+        head.tilesOffset + (uint64_t)head.tilesX*head.tilesY*tileBytes > head.fileSize ||
+        head.historyOffset > head.fileSize){
+        return false;
+    }
+
+    //history index, entries are read in place
+    uint32_t entries = head.undoCount + head.redoCount;
+    if((uint64_t)entries*sizeof(historyEntry) > head.fileSize - head.historyOffset)
+        return false;
+    const historyEntry *index = (const historyEntry*)(mapping->data + head.historyOffset);
+
+    int w = head.width;
+    int h = head.height;
+    int tile = head.tileSize;
+    source = wxString::FromUTF8((const char*)mapping->data + head.sourceOffset, head.sourceLength);
+    original = patchBuffer::view(mapping, head.originalOffset, (size_t)w*h);
+
+    //decode current image from its tiles
+    image = wxImage(w, h, false);
+    for(uint32_t ty = 0; ty < head.tilesY; ty++){
+        for(uint32_t tx = 0; tx < head.tilesX; tx++){
+            const unsigned char *tileData = mapping->data + head.tilesOffset + ((size_t)ty*head.tilesX + tx)*tileBytes;
+            int tw = std::min(tile, w - (int)tx*tile);
+            int th = std::min(tile, h - (int)ty*tile);
+            for(int i = 0; i < th; i++)
+                setGrayRect(image, tx*tile, ty*tile + i, tw, 1, tileData + (size_t)i*tile);
         }
+    }
 
-        /*get image operation from the top*/
-        ImageProcess pop(){
-            //verify empty stack
-            if(top == -1){
-                return ImageProcess();
-            }
+    //image size each history entry is applied to, a resize changes it for the entries around it
+    std::vector<int> sizeW(entries), sizeH(entries);
+    int currentW = w, currentH = h;
+    for(int i = (int)head.undoCount - 1; i >= 0; i--){
+        int resultW, resultH;
+        ImageProcess::resultSize(index[i].op_ID, index[i].w, index[i].h, index[i].param, resultW, resultH);
+        if(index[i].op_ID == OP_RESIZE && (resultW != currentW || resultH != currentH))
+            return false;
+        sizeW[i] = currentW = index[i].op_ID == OP_RESIZE ? index[i].w : currentW;
+        sizeH[i] = currentH = index[i].op_ID == OP_RESIZE ? index[i].h : currentH;
+    }
+    currentW = w;
+    currentH = h;
+    for(int i = entries - 1; i >= (int)head.undoCount; i--){
+        sizeW[i] = currentW;
+        sizeH[i] = currentH;
+        if(index[i].op_ID == OP_RESIZE)
+            ImageProcess::resultSize(index[i].op_ID, index[i].w, index[i].h, index[i].param, currentW, currentH);
+    }
 
-            //get data from the stack
-            ImageProcess topData = stack[top];
-            //update top 
-            top--;
+    //history entries keep views over their patches
+    for(uint32_t i = 0; i < entries; i++){
+        historyEntry entry = index[i];
+        int resultW, resultH;
+        ImageProcess::resultSize(entry.op_ID, entry.w, entry.h, entry.param, resultW, resultH);
+        size_t bytes = (size_t)resultW*resultH;
+        size_t oldBytes = (size_t)entry.w*entry.h;
+        //sizes are compared by difference so corrupted values can not overflow
+        if(entry.x < 0 || entry.y < 0 || entry.w <= 0 || entry.h <= 0 || entry.spans < 0 ||
+            entry.x >= sizeW[i] || entry.y >= sizeH[i] ||
+            entry.w > sizeW[i] - entry.x || entry.h > sizeH[i] - entry.y ||
+            entry.patchOffset > head.fileSize || entry.oldOffset > head.fileSize ||
+            (uint64_t)entry.spans*sizeof(spanMask::span) > head.fileSize - entry.patchOffset){
+            return false;
+        }
 
-            return topData;
+        //selection spans must rebuild the same bounding box
+        std::shared_ptr<spanMask> selection;
+        if(entry.spans > 0){
+            if(entry.op_ID == OP_RESIZE)
+                return false;
+            selection = std::make_shared<spanMask>();
+            const spanMask::span *spans = (const spanMask::span*)(mapping->data + entry.patchOffset);
+            for(int32_t k = 0; k < entry.spans; k++){
+                spanMask::span run;
+                memcpy(&run, spans + k, sizeof(run));
+                if(!selection->add(run.y, run.x, run.length))
+                    return false;
+            }
+            if(selection->getLeft() != entry.x || selection->getTop() != entry.y ||
+                selection->getWidth() != entry.w || selection->getHeight() != entry.h)
+                return false;
+            bytes = oldBytes = selection->area();
         }
+        if(filteredOffset(entry) > head.fileSize || bytes > head.fileSize - filteredOffset(entry) ||
+            oldBytes > head.fileSize - entry.oldOffset)
+            return false;
+
+        ImageProcess item(entry.op_ID, entry.x, entry.y, entry.w, entry.h, entry.param[0], entry.param[1],
+                            patchBuffer::view(mapping, filteredOffset(entry), bytes),
+                            patchBuffer::view(mapping, entry.oldOffset, oldBytes), selection);
+        if(i < head.undoCount)
+            undoItems.push_back(item);
+        else
+            redoItems.push_back(item);
+    }
 
-};
+    return true;
+}
 
 /*Image panel handler*/
 class wxImagePanel : public wxPanel
@@ -404,16 +785,32 @@ class wxImagePanel : public wxPanel
     wxImage image;
     wxBitmap m_bitmap;
     wxBitmap resized;
+    wxImage scaled;             //pixels of resized, rows are scaled again when only part of the image changes
     int w, h;
+    bool lassoActive;           //next drag over the panel draws a lasso
+    std::vector<int> outline;   //lasso drawn over the image (x, y pairs in image pixels)
+
+    wxPoint toImage(wxPoint position);
     
 public:
-    wxImagePanel(wxSplitterWindow *parent, wxString file, wxBitmapType format);
-    wxImagePanel(wxSplitterWindow *parent);
+    std::function<void(const std::vector<int>&)> onLasso;  //receives the lasso once the button is released
+
+    wxImagePanel(wxWindow *parent, wxString file, wxBitmapType format);
+    wxImagePanel(wxWindow *parent);
     void setImage(wxString file, wxBitmapType format);
     void setImage(wxBitmap new_bitMap, wxBitmapType format);
+    void setImage(wxImage new_image);
+    void updateRows(int top, int bottom);
     wxImage getImage();
     int getWidth();
     int getHeight();
+    size_t cacheBytes();
+    void dropCache();
+    void startLasso();
+    void clearOutline();
+    void OnLeftDown(wxMouseEvent& event);
+    void OnMotion(wxMouseEvent& event);
+    void OnLeftUp(wxMouseEvent& event);
     void paintEvent(wxPaintEvent & evt);
     void paintNow();
     void OnSize(wxSizeEvent& event);
@@ -426,12 +823,16 @@ public:
 BEGIN_EVENT_TABLE(wxImagePanel, wxPanel)
     EVT_PAINT(wxImagePanel::paintEvent)// catch paint events
     EVT_SIZE(wxImagePanel::OnSize)//Size event
+    EVT_LEFT_DOWN(wxImagePanel::OnLeftDown)//lasso selection
+    EVT_MOTION(wxImagePanel::OnMotion)
+    EVT_LEFT_UP(wxImagePanel::OnLeftUp)
 END_EVENT_TABLE()
 
 /*constructor with default local image (test purposes)*/
-wxImagePanel::wxImagePanel(wxSplitterWindow *parent, wxString file, wxBitmapType format) :
+wxImagePanel::wxImagePanel(wxWindow *parent, wxString file, wxBitmapType format) :
 wxPanel(parent){
     
+    lassoActive = false;
     m_bitmap.LoadFile(file, format);
     image = wxImage(m_bitmap.ConvertToImage());
     w = image.GetWidth();
@@ -439,7 +840,8 @@ wxPanel(parent){
 }
 
 /*starting program constructor*/
-wxImagePanel::wxImagePanel(wxSplitterWindow *parent):wxPanel(parent){
+wxImagePanel::wxImagePanel(wxWindow *parent):wxPanel(parent){
+    lassoActive = false;
     //default black image of size 100 x 100
     image = wxImage(100,100,true);
     w = image.GetWidth();
@@ -453,6 +855,7 @@ void wxImagePanel::setImage(wxString file, wxBitmapType format){
     image = wxImage(m_bitmap.ConvertToImage());
     w = image.GetWidth();
     h = image.GetHeight();
+    resized = wxBitmap();   //scaled again on the next paint
 }
 
 /*set new bitmap as a result of any process*/
@@ -462,6 +865,28 @@ void wxImagePanel::setImage(wxBitmap new_bitMap, wxBitmapType format){
     image = wxImage(new_bitMap.ConvertToImage());
     w = image.GetWidth();
     h = image.GetHeight();
+    resized = wxBitmap();   //scaled again on the next paint
+}
+
+/*set image modified in memory (operations and session restore)*/
+void wxImagePanel::setImage(wxImage new_image){
+
+    image = new_image;
+    w = image.GetWidth();
+    h = image.GetHeight();
+    resized = wxBitmap();   //scaled again on the next paint
+}
+
+/*rows [top, bottom) of the image were written in place, only the display rows reading them are scaled again*/
+void wxImagePanel::updateRows(int top, int bottom){
+    if(!resized.IsOk() || !scaled.IsOk())
+        return;
+    int rows[2];
+    resampleGray( viewOf(image), viewOf(scaled), RESAMPLE_BICUBIC, top, bottom, rows );
+    if(rows[0] >= rows[1])
+        return;
+    wxMemoryDC memory(resized);
+    memory.DrawBitmap( wxBitmap(scaled.GetSubImage(wxRect(0,rows[0],scaled.GetWidth(),rows[1]-rows[0]))), 0, rows[0], false );
 }
 
 /*getters*/
@@ -470,11 +895,78 @@ wxImage wxImagePanel::getImage(){
 }
 
 int wxImagePanel::getWidth(){
-    return w;
+    return image.GetWidth();
 }
 
 int wxImagePanel::getHeight(){
-    return h;
+    return image.GetHeight();
+}
+
+/*bytes of the bitmaps kept for display, they are built again from the image when needed*/
+size_t wxImagePanel::cacheBytes(){
+    size_t bytes = 0;
+    if(resized.IsOk())
+        bytes += (size_t)4*resized.GetWidth()*resized.GetHeight();
+    if(scaled.IsOk())
+        bytes += (size_t)3*scaled.GetWidth()*scaled.GetHeight();
+    if(m_bitmap.IsOk())
+        bytes += (size_t)4*m_bitmap.GetWidth()*m_bitmap.GetHeight();
+    return bytes;
+}
+
+void wxImagePanel::dropCache(){
+    resized = wxBitmap();
+    scaled = wxImage();
+    m_bitmap = wxBitmap();
+}
+
+/*the next drag over the image draws a lasso*/
+void wxImagePanel::startLasso(){
+    lassoActive = true;
+    outline.clear();
+    Refresh();
+}
+
+void wxImagePanel::clearOutline(){
+    lassoActive = false;
+    outline.clear();
+    Refresh();
+}
+
+/*pixel of the image under a point of the panel (the image is stretched over the whole panel)*/
+wxPoint wxImagePanel::toImage(wxPoint position){
+    wxSize size = GetClientSize();
+    if(size.GetWidth() <= 0 || size.GetHeight() <= 0)
+        return wxPoint(0,0);
+    return wxPoint(position.x*image.GetWidth()/size.GetWidth(), position.y*image.GetHeight()/size.GetHeight());
+}
+
+void wxImagePanel::OnLeftDown(wxMouseEvent& event){
+    if(!lassoActive)
+        return;
+    wxPoint point = toImage(event.GetPosition());
+    outline.assign({point.x,point.y});
+}
+
+/*add a vertex every time the pointer reaches another pixel of the image*/
+void wxImagePanel::OnMotion(wxMouseEvent& event){
+    if(!lassoActive || outline.empty() || !event.LeftIsDown())
+        return;
+    wxPoint point = toImage(event.GetPosition());
+    if(point.x == outline[outline.size()-2] && point.y == outline.back())
+        return;
+    outline.push_back(point.x);
+    outline.push_back(point.y);
+    Refresh();
+}
+
+void wxImagePanel::OnLeftUp(wxMouseEvent& event){
+    if(!lassoActive || outline.empty())
+        return;
+    lassoActive = false;
+    Refresh();
+    if(onLasso)
+        onLasso(outline);
 }
 
 /*Refresh the image whith any change or event associated (triggered manually by calling Refresh()/Update())*/
@@ -493,16 +985,31 @@ void wxImagePanel::paintNow(){
 void wxImagePanel::render(wxDC&  dc){
     int neww, newh;
     dc.GetSize( &neww, &newh );
+    if( neww <= 0 || newh <= 0 )
+        return;
     
-    if( neww != w || newh != h )
+    //scale only when the panel or the image changed (area average when reducing, bicubic when enlarging)
+    if( !resized.IsOk() || neww != w || newh != h )
     {
-        resized = wxBitmap( image.Scale( neww, newh /*, wxIMAGE_QUALITY_HIGH*/ ) );
+        scaled = wxImage( neww, newh, false );
+        resampleGray( viewOf(image), viewOf(scaled), RESAMPLE_BICUBIC );
+        resized = wxBitmap( scaled );
         w = neww;
         h = newh;
-        dc.DrawBitmap( resized, 0, 0, false );
-    }else{
-        dc.DrawBitmap( resized, 0, 0, false );
     }
+    dc.DrawBitmap( resized, 0, 0, false );
+
+    //lasso over the scaled image, closed once it is finished
+    int points = outline.size() / 2;
+    if(points < 2)
+        return;
+    std::vector<wxPoint> lasso(points);
+    for(int i = 0; i < points; i++)
+        lasso[i] = wxPoint(outline[2*i]*neww/image.GetWidth(), outline[2*i+1]*newh/image.GetHeight());
+    if(!lassoActive)
+        lasso.push_back(lasso[0]);
+    dc.SetPen(*wxRED_PEN);
+    dc.DrawLines((int)lasso.size(), lasso.data());
 }
 
 /*tell the panel to draw itself again (when the user resizes the image panel)*/
@@ -512,21 +1019,79 @@ void wxImagePanel::OnSize(wxSizeEvent& event){
     event.Skip();
 }
 
-/*pointer to member functions using order of declaration in the listBox*/
-typedef wxBitmap(ImageProcess::*Functionsptr)(wxImage &image);
+/*entries of the operations list in display order: label, operation and the parameters it uses*/
+struct operationInfo{
+    const wxChar *label;
+    int op_ID;
+    int params;                     //parameter controls enabled (0, 1 or 2)
+    const wxChar *paramLabel[2];
+    double minValue[2];
+    double maxValue[2];
+    double initial[2];
+    double step[2];
+};
+
+const operationInfo operationList[] = {
+    {wxT("Bordes"), OP_SOBEL, 0, {wxT(""),wxT("")}, {0,0}, {0,0}, {0,0}, {1,1}},
+    {wxT("Bordes (Canny)"), OP_CANNY, 2, {wxT("Umbral bajo:"),wxT("Umbral alto:")},
+        {0,0}, {1500,1500}, {50,100}, {5,5}},
+    {wxT("Invertir"), OP_NEGATIVE, 0, {wxT(""),wxT("")}, {0,0}, {0,0}, {0,0}, {1,1}},
+    {wxT("Suavizado"), OP_GAUSS, 0, {wxT(""),wxT("")}, {0,0}, {0,0}, {0,0}, {1,1}},
+    {wxT("Contraste"), OP_CONTRAST, 2, {wxT("α:"),wxT("β:")}, {0,-255}, {3,255}, {1,0}, {0.2,1}},
+    {wxT("Erosion"), OP_ERODE, 2, {wxT("Ancho elemento:"),wxT("Alto elemento:")}, {1,1}, {1001,1001}, {3,3}, {1,1}},
+    {wxT("Dilatacion"), OP_DILATE, 2, {wxT("Ancho elemento:"),wxT("Alto elemento:")}, {1,1}, {1001,1001}, {3,3}, {1,1}},
+    {wxT("Apertura"), OP_OPEN, 2, {wxT("Ancho elemento:"),wxT("Alto elemento:")}, {1,1}, {1001,1001}, {3,3}, {1,1}},
+    {wxT("Cierre"), OP_CLOSE, 2, {wxT("Ancho elemento:"),wxT("Alto elemento:")}, {1,1}, {1001,1001}, {3,3}, {1,1}},
+    {wxT("Top-hat"), OP_TOPHAT, 2, {wxT("Ancho elemento:"),wxT("Alto elemento:")}, {1,1}, {1001,1001}, {15,15}, {1,1}},
+    {wxT("Escalar imagen"), OP_RESIZE, 2, {wxT("Escala (%):"),wxT("Interpolacion (1-3):")}, {1,1}, {800,3}, {50,2}, {5,1}},
+    {wxT("Ecualizacion (CLAHE)"), OP_CLAHE, 2, {wxT("Teselas por lado:"),wxT("Limite de recorte:")}, {1,0}, {64,40}, {8,2}, {1,0.5}},
+    {wxT("Suavizado bilateral"), OP_BILATERAL, 2, {wxT("Sigma espacial:"),wxT("Sigma de rango:")}, {1,1}, {64,128}, {8,25}, {1,1}}
+};
+const int OPERATIONS = sizeof(operationList)/sizeof(operationList[0]);
+
+/*label of an operation identifier*/
+wxString operationName(int op_ID){
+    for(int i = 0; i < OPERATIONS; i++){
+        if(operationList[i].op_ID == op_ID)
+            return operationList[i].label;
+    }
+    return wxT("?");
+}
  
+long sessionTag = 0;    //0 when this instance owns the session files of the directory, its pid otherwise
+
+/*an open image with its own history, journal and loading state*/
+struct imageDocument{
+    wxImagePanel *panel;                                    //notebook page where the image is displayed
+    operationStack undoStack;                               //stack instance for undo function
+    operationStack redoStack;                               //stack instance for redo function
+    sessionJournal journal;                                 //append-only record of the document
+    int slot = 0;                                           //number of its journal and spill files
+    int opsSinceCheckpoint = 0;                             //operations, undos and redos journaled after the last checkpoint
+    patchBuffer originalImage;                              //gray pixels of the image as it was opened
+    wxString sourcePath;                                    //path of the opened image
+    pgmLoader loader;                                       //background decoding of the opened image
+    bool loading = false;                                   //true until every row of the image is decoded
+    bool previewShown = false;                              //sampled preview already drawn
+    int rowsShown = 0;                                      //decoded rows copied to the image
+    bool spilled = false;                                   //image and history moved to the spill file
+    bool blank = false;                                     //default page of a new session, not used yet
+    std::shared_ptr<const spanMask> selection;              //lasso or threshold selection (null operates the square)
+    long lastUse = 0;                                       //use clock when the document was last shown
+};
+
 class MyFrame : public wxFrame{
     public:
         MyFrame(wxBoxSizer *sizer);
+        ~MyFrame();
 
     private:
-        Functionsptr opArr[3] = {&ImageProcess::sobel_filter,   //array of pointers to functions
-                                &ImageProcess::negative,
-                                &ImageProcess::gauss_filter};
-        operationStack undoStack;                               //stack instance for undo function
-        operationStack redoStack;                               //stack instance for redo function
+        std::vector<imageDocument*> documents;                  //open images in notebook page order
+        imageDocument *doc = nullptr;                           //document of the selected page
+        long useClock = 0;                                      //counter ordering documents by last use
+        size_t memoryBudget = (size_t)MEMORYBUDGET << 20;       //bytes for images, histories and display of all documents
         int XYLimit[2] = {0,0};                                 //Array for max limits on spincontrols
-        wxImagePanel *drawPanel;                                //instance of panel where image is displayed
+        wxNotebook *notebook;                                   //instance of notebook with a page per image
         wxPanel *optionPanel;                                   //instance of panel where options are displayed
         wxPanel *logPanel;                                      //instance of panel where logbox is displayed
         wxButton *undoBtn;                                      //pointer to instance of "deshacer" button
@@ -536,19 +1101,53 @@ class MyFrame : public wxFrame{
         wxSpinCtrl *yUpperLeft;                                 //pointer to instance of "Y" spin control
         wxSpinCtrl *width;                                      //pointer to instance of "W" spin control
         wxSpinCtrl *height;                                     //pointer to instance of "H" spin control
-        wxSpinCtrlDouble *alpha;                                //pointer to instance of "alpha" double spin control
-        wxSpinCtrl *beta;                                       //pointer to instance of "beta" spin control
+        wxSpinCtrlDouble *param1;                               //pointer to instance of first parameter spin control
+        wxSpinCtrlDouble *param2;                               //pointer to instance of second parameter spin control
+        wxStaticText *param1Label;                              //pointer to instance of first parameter label
+        wxStaticText *param2Label;                              //pointer to instance of second parameter label
         wxButton *apply;                                        //pointer to instance of "aplicar" button
         wxTextCtrl *textlog;                                    //pointer to instance of "Log" textbox
+        bool replaying = false;                                 //true while the journal is being replayed
+        wxTimer loadTimer;                                      //shows decoded rows while images load
+        int lockFd = -1;                                        //descriptor holding the lock of LOCKFILE
 
 
         void setTextInLog(wxString logMessage);
         void resetFrame();
+        void updateLimits();
+        void showPatch(ImageProcess &img_op, int patch_mode);
         void updateUndoRedo(int type);
+        void setParamControls(int item);
+        void applyOperation(int operation, int *square, double param1Value, double param2Value,
+                            std::shared_ptr<const spanMask> selection = nullptr);
+        void journalPatch(int type, ImageProcess &img_op, int patch_mode);
+        void getSquare(int *square);
+        void setSelection(imageDocument *document, const spanMask &mask);
+        void undoOperation();
+        void redoOperation();
+        void checkpointSession(imageDocument *document);
+        void restoreSession();
+        bool restoreDocument(int slot);
+        void openProject(wxString path);
+        void stopLoading(imageDocument *document);
+        void showLoadedRows(imageDocument *document);
+        imageDocument *newDocument(wxString title);
+        void selectDocument(int page);
+        void closeDocument(imageDocument *document);
+        size_t documentBytes(imageDocument *document);
+        void enforceBudget();
+        void forgetResults(imageDocument *document);
+        void spillDocument(imageDocument *document);
+        void unspillDocument(imageDocument *document);
 
         //static event handling
         void OnOpen(wxCommandEvent& event);
         void OnSave(wxCommandEvent& event);
+        void OnClose(wxCommandEvent& event);
+        void OnBudget(wxCommandEvent& event);
+        void OnLasso(wxCommandEvent& event);
+        void OnThreshold(wxCommandEvent& event);
+        void OnSelectSquare(wxCommandEvent& event);
         void OnExit(wxCommandEvent& event);
         void OnAbout(wxCommandEvent& event);
         void OnButtonUndoClick(wxCommandEvent& event);
@@ -557,6 +1156,8 @@ class MyFrame : public wxFrame{
         void OnXULSpinChange(wxCommandEvent& event);
         void OnYULSpinChange(wxCommandEvent& event);
         void OnButtonApplyClick(wxCommandEvent& event);
+        void OnLoadTimer(wxTimerEvent& event);
+        void OnPageChanged(wxBookCtrlEvent& event);
         DECLARE_EVENT_TABLE();
         
 };
@@ -576,18 +1177,32 @@ enum{
     SPINCTRLD = 10,
     SPINCTRL5 = 11,
     BUTTON3 = 12,
-    TEXTBOX = 13
+    TEXTBOX = 13,
+    LOADTIMER = 14,
+    ID_Close = 15,
+    ID_Budget = 16,
+    NOTEBOOK = 17,
+    ID_Lasso = 18,
+    ID_Threshold = 19,
+    ID_SelectSquare = 20
 };
 
 BEGIN_EVENT_TABLE(MyFrame, wxFrame)
     EVT_MENU(ID_Open,MyFrame::OnOpen)
     EVT_MENU(ID_Save,MyFrame::OnSave)
+    EVT_MENU(ID_Close,MyFrame::OnClose)
+    EVT_MENU(ID_Budget,MyFrame::OnBudget)
+    EVT_MENU(ID_Lasso,MyFrame::OnLasso)
+    EVT_MENU(ID_Threshold,MyFrame::OnThreshold)
+    EVT_MENU(ID_SelectSquare,MyFrame::OnSelectSquare)
     EVT_MENU(wxID_ABOUT,MyFrame::OnAbout)
     EVT_MENU(wxID_EXIT,MyFrame::OnExit)
     EVT_BUTTON(BUTTON1,MyFrame::OnButtonUndoClick)
     EVT_BUTTON(BUTTON2,MyFrame::OnButtonRedoClick)
     EVT_LISTBOX(LISTBOX,MyFrame::OnListBoxSelection)
     EVT_BUTTON(BUTTON3,MyFrame::OnButtonApplyClick)
+    EVT_TIMER(LOADTIMER,MyFrame::OnLoadTimer)
+    EVT_NOTEBOOK_PAGE_CHANGED(NOTEBOOK,MyFrame::OnPageChanged)
 END_EVENT_TABLE()
 
 //////////////////////////////////////////////////////////////////window elements initialization
@@ -596,22 +1211,26 @@ END_EVENT_TABLE()
 /*Elemnts initialization associated with the main window*/
 MyFrame::MyFrame(wxBoxSizer *sizer)
     : wxFrame(nullptr, wxID_ANY, "Proyecto P y A I",wxPoint(1200,1200), wxSize(1200,700)){
-    //initialize operations history stacks
-    undoStack = operationStack();
-    redoStack = operationStack();
-
     //initialize top menu
     wxMenu *menuFile = new wxMenu;
-    menuFile->Append(ID_Open, "&Abrir...\tCtrl-O","Abrir imagen");
+    menuFile->Append(ID_Open, "&Abrir...\tCtrl-O","Abrir imagen en una nueva pestaña");
     menuFile->AppendSeparator();
     menuFile->Append(ID_Save, "&Guardar...\tCtrl-S","Guardar como nueva imagen");
+    menuFile->Append(ID_Close, "&Cerrar imagen\tCtrl-W","Cerrar la pestaña actual");
+    menuFile->Append(ID_Budget, "&Memoria...","Memoria disponible para todas las imagenes abiertas");
     menuFile->Append(wxID_EXIT,"Salir","Cerrar programa");
  
+    wxMenu *menuSelect = new wxMenu;
+    menuSelect->Append(ID_Lasso, "&Lazo","Dibujar con el raton el area a operar");
+    menuSelect->Append(ID_Threshold, "&Umbral...","Operar los pixeles del rectangulo con valor dentro de un rango");
+    menuSelect->Append(ID_SelectSquare, "&Rectangulo","Operar el rectangulo de los controles");
+
     wxMenu *menuHelp = new wxMenu;
     menuHelp->Append(wxID_ABOUT);
  
     wxMenuBar *menuBar = new wxMenuBar;
     menuBar->Append(menuFile, "&File");
+    menuBar->Append(menuSelect, "&Seleccion");
     menuBar->Append(menuHelp, "&Help");
     SetMenuBar( menuBar );
 
@@ -623,25 +1242,23 @@ MyFrame::MyFrame(wxBoxSizer *sizer)
                                 wxSP_BORDER | wxSP_LIVE_UPDATE);
     
     optionPanel = new wxPanel(splitter);
-    /*drawPanel = new wxImagePanel(rightsplitter, 
-                wxT("/home/edgarbanzo/Programs/PyA/Proyecto/resources/barbara_ascii.pgm"), wxBITMAP_TYPE_PNM);*/
-    drawPanel = new wxImagePanel(rightsplitter);
+    //one page (image panel) per open image
+    notebook = new wxNotebook(rightsplitter,NOTEBOOK);
     sizer = new wxBoxSizer(wxHORIZONTAL);
     rightsplitter->SetSizer(sizer);
-    sizer->Add(drawPanel, 1, wxEXPAND);
+    sizer->Add(notebook, 1, wxEXPAND);
 
     logPanel = new wxPanel(rightsplitter);
 
     splitter->SetMinimumPaneSize(200);
     splitter->SplitVertically(optionPanel,rightsplitter);
     rightsplitter->SetMinimumPaneSize(150);
-    rightsplitter->SplitHorizontally(drawPanel,logPanel);
+    rightsplitter->SplitHorizontally(notebook,logPanel);
     rightsplitter->SetSashPosition(-50);
     rightsplitter->SetSashGravity(1);
 
-    //get image size
-    XYLimit[0] = drawPanel->getWidth();
-    XYLimit[1] = drawPanel->getHeight();
+    //size of the default image until a document is shown
+    XYLimit[0] = XYLimit[1] = 100;
 
     //buttons initialization
     undoBtn = new wxButton(optionPanel,BUTTON1,_T("Deshacer"),wxPoint(10,10));
@@ -653,12 +1270,12 @@ MyFrame::MyFrame(wxBoxSizer *sizer)
     apply = new wxButton(optionPanel,BUTTON3,_T("Aplicar"),wxPoint(350,300));
     apply->SetBackgroundColour(wxColour(117, 240, 230));
     apply->Disable();
-    wxString choices[] = {_T("Bordes"),
-                        _T("Invertir"),
-                        _T("Suavizado"),
-                        _T("Contraste")};
+    wxString choices[OPERATIONS];
+    for(int i = 0; i < OPERATIONS; i++){
+        choices[i] = operationList[i].label;
+    }
     filterList = new wxListBox(optionPanel,LISTBOX,wxPoint(10,100), wxSize(125,100),
-                        4, choices, wxLB_SINGLE);
+                        OPERATIONS, choices, wxLB_SINGLE);
     
     xUpperLeft = new wxSpinCtrl(optionPanel,SPINCTRL1,"0",wxPoint(170,100),wxSize(125,34));
     xUpperLeft->SetRange(0,XYLimit[0]-1);
@@ -669,11 +1286,12 @@ MyFrame::MyFrame(wxBoxSizer *sizer)
     height = new wxSpinCtrl(optionPanel,SPINCTRL4,"0",wxPoint(350,180),wxSize(125,34));
     height->SetRange(0,XYLimit[1]-1);
 
-    alpha = new wxSpinCtrlDouble(optionPanel,SPINCTRLD,"1.0",wxPoint(170,230),wxDefaultSize,
-                    wxSP_ARROW_KEYS,0.0,3.0,1.0,0.2);
-    alpha->Disable();
-    beta = new wxSpinCtrl(optionPanel,SPINCTRL5,"0",wxPoint(350,230),wxDefaultSize);
-    beta->Disable();
+    param1 = new wxSpinCtrlDouble(optionPanel,SPINCTRLD,"0",wxPoint(170,230),wxDefaultSize,
+                    wxSP_ARROW_KEYS,0.0,1.0,0.0,1.0);
+    param1->Disable();
+    param2 = new wxSpinCtrlDouble(optionPanel,SPINCTRL5,"0",wxPoint(350,230),wxDefaultSize,
+                    wxSP_ARROW_KEYS,0.0,1.0,0.0,1.0);
+    param2->Disable();
 
     wxBoxSizer *logSizer = new wxBoxSizer(wxVERTICAL);
     logPanel->SetSizer(logSizer);
@@ -689,8 +1307,8 @@ MyFrame::MyFrame(wxBoxSizer *sizer)
     new wxStaticText(optionPanel,wxID_ANY,"Dimension del area a operar",wxPoint(170,160),wxDefaultSize);
     new wxStaticText(optionPanel,wxID_ANY,"W:",wxPoint(150,189),wxDefaultSize);
     new wxStaticText(optionPanel,wxID_ANY,"H:",wxPoint(330,189),wxDefaultSize);
-    new wxStaticText(optionPanel,wxID_ANY,wxT("α:"),wxPoint(150,239),wxDefaultSize);
-    new wxStaticText(optionPanel,wxID_ANY,wxT("β:"),wxPoint(330,239),wxDefaultSize);
+    param1Label = new wxStaticText(optionPanel,wxID_ANY,"",wxPoint(170,210),wxDefaultSize);
+    param2Label = new wxStaticText(optionPanel,wxID_ANY,"",wxPoint(350,210),wxDefaultSize);
 
     //Status Message at the bottom of the window
     CreateStatusBar();
@@ -699,6 +1317,459 @@ MyFrame::MyFrame(wxBoxSizer *sizer)
     //dynamic events binding
     Bind(wxEVT_SPINCTRL, &MyFrame::OnXULSpinChange, this,SPINCTRL1);
     Bind(wxEVT_SPINCTRL, &MyFrame::OnYULSpinChange, this,SPINCTRL2);
+    loadTimer.SetOwner(this,LOADTIMER);
+
+    //only one instance per directory owns the session files, others use names of their own
+    lockFd = ::open(LOCKFILE, O_RDWR | O_CREAT, 0644);
+    if(lockFd < 0 || flock(lockFd, LOCK_EX | LOCK_NB) != 0){
+        sessionTag = getpid();
+        setTextInLog(wxT("Otra instancia usa este directorio, esta sesion no podra restaurarse"));
+    }
+
+    //recover the documents of the previous session if their journals exist
+    restoreSession();
+}
+
+/*journal file of a document slot (the first slot keeps the name of single image sessions)*/
+static wxString journalPath(int slot){
+    if(sessionTag != 0)
+        return wxString::Format(PIDJOURNAL,sessionTag,slot);
+    if(slot == 0)
+        return JOURNALFILE;
+    return wxString::Format(SLOTJOURNAL,slot);
+}
+
+/*file where the memory budget moves the image and history of a document slot*/
+static wxString spillPath(int slot){
+    if(sessionTag != 0)
+        return wxString::Format(PIDSPILL,sessionTag,slot);
+    return wxString::Format(SPILLFILE,slot);
+}
+
+/*stop background decoding before the documents go away, a clean exit leaves no session to recover*/
+MyFrame::~MyFrame(){
+    loadTimer.Stop();
+    for(size_t i = 0; i < documents.size(); i++){
+        int slot = documents[i]->slot;
+        delete documents[i];
+        unlink(journalPath(slot).fn_str());
+        unlink(spillPath(slot).fn_str());
+    }
+    if(lockFd >= 0)
+        ::close(lockFd);
+}
+
+/*write the current image of a document as a checkpoint, older journal records are discarded*/
+void MyFrame::checkpointSession(imageDocument *document){
+    wxImage image = document->panel->getImage();
+    document->journal.checkpoint(viewOf(image));
+    document->opsSinceCheckpoint = 0;
+}
+
+/*journal with nothing but the checkpoint of a black image (a blank page that was never used)*/
+static bool blankJournal(const std::vector<sessionJournal::record> &records){
+    if(records.size() != 1)
+        return false;
+    const std::vector<unsigned char> &payload = records[0].payload;
+    for(size_t i = 2*sizeof(int32_t); i < payload.size(); i++)
+        if(payload[i] != 0)
+            return false;
+    return true;
+}
+
+/*rebuild the documents of the previous session from their journals*/
+void MyFrame::restoreSession(){
+    //spill files only hold data of a running session
+    std::vector<int> slots;
+    std::vector<sessionJournal::record> records;
+    //(an instance without the lock has no previous session and must not touch the files of the owner)
+    for(int slot = 0; sessionTag == 0 && slot < MAXDOCUMENTS; slot++){
+        unlink(spillPath(slot).fn_str());
+        if(!sessionJournal::load(journalPath(slot).fn_str(),records))
+            continue;
+        if(blankJournal(records))
+            unlink(journalPath(slot).fn_str());
+        else
+            slots.push_back(slot);
+    }
+
+    if(!slots.empty() &&
+        wxMessageBox("Se encontro una sesion anterior, ¿desea restaurarla?","Restaurar sesion",
+                        wxYES_NO | wxICON_QUESTION) == wxYES){
+        for(size_t i = 0; i < slots.size(); i++)
+            restoreDocument(slots[i]);
+        if(!documents.empty())
+            return;
+    }
+
+    //start a new journal with the default image
+    for(size_t i = 0; i < slots.size(); i++)
+        unlink(journalPath(slots[i]).fn_str());
+    imageDocument *document = newDocument(wxT("Sin imagen"));
+    document->blank = true;
+    document->journal.open(journalPath(document->slot).fn_str(),false);
+    checkpointSession(document);
+}
+
+/*rectangle of a journal record inside an image (compared by difference so corrupted values can not overflow)*/
+static bool insideImage(int x, int y, int w, int h, int width, int height){
+    return x >= 0 && y >= 0 && w > 0 && h > 0 && x < width && y < height &&
+            w <= width - x && h <= height - y;
+}
+
+/*rebuild image and history of one document from the latest checkpoint in its journal*/
+bool MyFrame::restoreDocument(int slot){
+    std::vector<sessionJournal::record> records;
+    if(!sessionJournal::load(journalPath(slot).fn_str(),records))
+        return false;
+
+    //set checkpoint image
+    int32_t size[2];
+    if(records[0].payload.size() < sizeof(size))
+        return false;
+    memcpy(size,records[0].payload.data(),sizeof(size));
+    if(size[0] <= 0 || size[1] <= 0 || (size_t)size[0]*size[1] != records[0].payload.size() - sizeof(size))
+        return false;
+    wxImage image(size[0],size[1],false);
+    setGrayRect(image,0,0,size[0],size[1],records[0].payload.data()+sizeof(size));
+    imageDocument *document = newDocument(wxString::Format(wxT("Sesion %d"),slot+1));
+    document->slot = slot;
+    doc->panel->setImage(image);
+    resetFrame();
+
+    //run every operation again without writing it twice
+    replaying = true;
+    for(size_t i = 1; i < records.size(); i++){
+        const unsigned char *payload = records[i].payload.data();
+        if(records[i].type == sessionJournal::REC_APPLY){
+            sessionJournal::opRecord op;
+            if(records[i].payload.size() != sizeof(op))
+                continue;
+            memcpy(&op,payload,sizeof(op));
+            int square[] = {op.x,op.y,op.w,op.h};
+            //resize always takes the whole image
+            if(op.op_ID == OP_RESIZE || insideImage(op.x,op.y,op.w,op.h,XYLimit[0],XYLimit[1]))
+                applyOperation(op.op_ID,square,op.param[0],op.param[1]);
+        }else if(records[i].type == sessionJournal::REC_MASKAPPLY){
+            //spans of the selection follow the operation
+            sessionJournal::opRecord op;
+            if(records[i].payload.size() < sizeof(op))
+                continue;
+            memcpy(&op,payload,sizeof(op));
+            int square[] = {op.x,op.y,op.w,op.h};
+            std::shared_ptr<spanMask> selection = std::make_shared<spanMask>();
+            size_t count = (records[i].payload.size() - sizeof(op)) / sizeof(spanMask::span);
+            if(sessionJournal::readSpans(payload + sizeof(op),count,*selection) &&
+                selection->getLeft() + selection->getWidth() <= XYLimit[0] &&
+                selection->getTop() + selection->getHeight() <= XYLimit[1])
+                applyOperation(op.op_ID,square,op.param[0],op.param[1],selection);
+        }else if(records[i].type == sessionJournal::REC_UNDO || records[i].type == sessionJournal::REC_REDO ||
+                    records[i].type == sessionJournal::REC_MASKUNDO || records[i].type == sessionJournal::REC_MASKREDO){
+            //undo/redo pixels are copied back as they were written
+            image = doc->panel->getImage();
+            if(records[i].type == sessionJournal::REC_MASKUNDO || records[i].type == sessionJournal::REC_MASKREDO){
+                int32_t count = 0;
+                if(records[i].payload.size() >= sizeof(count))
+                    memcpy(&count,payload,sizeof(count));
+                size_t spanBytes = (size_t)count*sizeof(spanMask::span);
+                spanMask selection;
+                if(count > 0 && sizeof(count) + spanBytes <= records[i].payload.size() &&
+                    sessionJournal::readSpans(payload + sizeof(count),count,selection) &&
+                    sizeof(count) + spanBytes + selection.area() == records[i].payload.size() &&
+                    selection.getLeft() + selection.getWidth() <= XYLimit[0] &&
+                    selection.getTop() + selection.getHeight() <= XYLimit[1])
+                    selection.scatter(viewOf(image),payload + sizeof(count) + spanBytes);
+            }else{
+                int32_t rect[4];
+                if(records[i].payload.size() >= sizeof(rect)){
+                    memcpy(rect,payload,sizeof(rect));
+                    if(insideImage(rect[0],rect[1],rect[2],rect[3],XYLimit[0],XYLimit[1]) &&
+                        records[i].payload.size() - sizeof(rect) == (size_t)rect[2]*rect[3])
+                        setGrayRect(image,rect[0],rect[1],rect[2],rect[3],payload+sizeof(rect));
+                }
+            }
+            doc->panel->setImage(image);
+
+            //move the operation between stacks if it was applied after the checkpoint
+            bool undo = records[i].type == sessionJournal::REC_UNDO || records[i].type == sessionJournal::REC_MASKUNDO;
+            if(undo && doc->undoStack.getElements() > 0)
+                doc->redoStack.push(doc->undoStack.pop());
+            else if(!undo && doc->redoStack.getElements() > 0)
+                doc->undoStack.push(doc->redoStack.pop());
+            updateUndoRedo(0);
+        }
+    }
+    replaying = false;
+    doc->opsSinceCheckpoint = records.size()-1;
+    doc->panel->Refresh();
+
+    doc->journal.open(journalPath(slot).fn_str(),true);
+    wxString logMessage = wxString::Format(wxT("Sesion restaurada (w:%d,h:%d) con %d registros"),
+                                            XYLimit[0],XYLimit[1],(int)records.size()-1);
+    setTextInLog(logMessage);
+    return true;
+}
+
+/*page for a new image, the blank page of a new session is taken instead if it was never used*/
+imageDocument *MyFrame::newDocument(wxString title){
+    if(doc && doc->blank && !doc->loading &&
+        doc->undoStack.getElements() == 0 && doc->redoStack.getElements() == 0){
+        notebook->SetPageText(notebook->GetSelection(),title);
+        doc->blank = false;
+        return doc;
+    }
+
+    imageDocument *document = new imageDocument();
+    //lowest slot free for its journal and spill files
+    auto used = [&](int slot){
+        for(size_t i = 0; i < documents.size(); i++)
+            if(documents[i]->slot == slot)
+                return true;
+        return false;
+    };
+    while(used(document->slot))
+        document->slot++;
+    document->panel = new wxImagePanel(notebook);
+    document->panel->onLasso = [this, document](const std::vector<int> &points){
+        setSelection(document,spanMask::polygon(points,document->panel->getWidth(),document->panel->getHeight()));
+    };
+    documents.push_back(document);
+    notebook->AddPage(document->panel,title,false);
+    selectDocument(documents.size()-1);
+    return document;
+}
+
+/*make the document of a notebook page the one operated by the controls*/
+void MyFrame::selectDocument(int page){
+    if(page < 0 || page >= (int)documents.size())
+        return;
+    doc = documents[page];
+    if(notebook->GetSelection() != page)
+        notebook->ChangeSelection(page);
+    if(doc->spilled)
+        unspillDocument(doc);
+    doc->lastUse = ++useClock;
+
+    updateLimits();
+    updateUndoRedo(0);
+    enforceBudget();
+}
+
+/*Notebook page selected by the user*/
+void MyFrame::OnPageChanged(wxBookCtrlEvent& event){
+    int page = event.GetSelection();
+    if(page >= 0 && page < (int)documents.size() && documents[page] != doc)
+        selectDocument(page);
+}
+
+/*bytes of a document kept in memory: image, display bitmap and history not backed by a file*/
+size_t MyFrame::documentBytes(imageDocument *document){
+    if(document->spilled)
+        return 0;
+    size_t bytes = (size_t)3*document->panel->getWidth()*document->panel->getHeight() +
+                    document->panel->cacheBytes();
+    if(!document->originalImage.isMapped())
+        bytes += document->originalImage.size();
+    for(int i = 0; i < document->undoStack.getElements(); i++)
+        bytes += document->undoStack.peek(i).memoryBytes();
+    for(int i = 0; i < document->redoStack.getElements(); i++)
+        bytes += document->redoStack.peek(i).memoryBytes();
+    return bytes;
+}
+
+/*keep every document within the memory budget: the least recently shown ones drop their display
+  bitmap first and are moved to disk after that (the selected and loading documents stay)*/
+void MyFrame::enforceBudget(){
+    //free pool blocks and results no history shares are counted once, for all documents
+    size_t shared = patchPool.bytesCached + results.ownedBytes();
+    size_t total = shared;
+    std::vector<imageDocument*> candidates;
+    for(size_t i = 0; i < documents.size(); i++){
+        total += documentBytes(documents[i]);
+        if(documents[i] != doc && !documents[i]->loading && !documents[i]->spilled)
+            candidates.push_back(documents[i]);
+    }
+    if(total <= memoryBudget)
+        return;
+
+    //those go first, nothing has to be read back from disk for them
+    results.dropOwned();
+    patchPool.trim();
+    total -= shared;
+    std::sort(candidates.begin(),candidates.end(),
+                [](imageDocument *a, imageDocument *b){return a->lastUse < b->lastUse;});
+
+    for(size_t i = 0; i < candidates.size() && total > memoryBudget; i++){
+        total -= candidates[i]->panel->cacheBytes();
+        candidates[i]->panel->dropCache();
+    }
+    for(size_t i = 0; i < candidates.size() && total > memoryBudget; i++){
+        size_t bytes = documentBytes(candidates[i]);
+        spillDocument(candidates[i]);
+        if(candidates[i]->spilled)
+            total -= bytes;
+    }
+    //blocks released by spilling are not kept for reuse
+    patchPool.trim();
+}
+
+/*drop cached results pinning the history patches of a document*/
+void MyFrame::forgetResults(imageDocument *document){
+    for(int i = 0; i < document->undoStack.getElements(); i++)
+        document->undoStack.peek(i).forgetResults();
+    for(int i = 0; i < document->redoStack.getElements(); i++)
+        document->redoStack.peek(i).forgetResults();
+}
+
+/*move image, original and history of a document to its spill file (pages are read back on demand)*/
+void MyFrame::spillDocument(imageDocument *document){
+    wxImage image = document->panel->getImage();
+    size_t bytes = documentBytes(document);
+    if(!projectFile::save(spillPath(document->slot).fn_str(),image,document->originalImage,
+                            document->sourcePath,document->undoStack,document->redoStack)){
+        setTextInLog(wxT("No se pudo mover a disco una imagen fuera del presupuesto de memoria"));
+        return;
+    }
+
+    document->panel->setImage(wxImage(1,1,true));
+    document->panel->dropCache();
+    forgetResults(document);
+    document->undoStack.clearStack();
+    document->redoStack.clearStack();
+    document->originalImage = patchBuffer();
+    document->spilled = true;
+
+    wxString logMessage = wxString::Format(wxT("Imagen %s movida a disco, %zu KB liberados"),
+                                            document->sourcePath,bytes/1024);
+    setTextInLog(logMessage);
+}
+
+/*bring back a document from its spill file, history patches stay mapped from the file*/
+void MyFrame::unspillDocument(imageDocument *document){
+    wxImage image;
+    patchBuffer original;
+    wxString source;
+    std::vector<ImageProcess> undoItems, redoItems;
+    if(!projectFile::open(spillPath(document->slot).fn_str(),image,original,source,undoItems,redoItems)){
+        wxMessageBox("Hubo un problema al recuperar la imagen desde disco","Error", wxOK);
+        return;
+    }
+
+    document->panel->setImage(image);
+    document->originalImage = original;
+    for(size_t i = 0; i < undoItems.size(); i++)
+        document->undoStack.push(undoItems[i]);
+    for(size_t i = 0; i < redoItems.size(); i++)
+        document->redoStack.push(redoItems[i]);
+    document->spilled = false;
+}
+
+/*close the selected image*/
+void MyFrame::OnClose(wxCommandEvent& event){
+    closeDocument(doc);
+}
+
+/*remove a document and its page, its journal is discarded*/
+void MyFrame::closeDocument(imageDocument *document){
+    int page = std::find(documents.begin(),documents.end(),document) - documents.begin();
+    stopLoading(document);
+    document->journal.close();
+    unlink(journalPath(document->slot).fn_str());
+    unlink(spillPath(document->slot).fn_str());
+
+    if(document == doc)
+        doc = nullptr;
+    forgetResults(document);
+    documents.erase(documents.begin() + page);
+    notebook->DeletePage(page);
+    delete document;
+
+    //a session always has one page
+    if(documents.empty()){
+        imageDocument *blank = newDocument(wxT("Sin imagen"));
+        blank->blank = true;
+        blank->journal.open(journalPath(blank->slot).fn_str(),false);
+        checkpointSession(blank);
+    }else if(!doc){
+        selectDocument(std::min(page,(int)documents.size()-1));
+    }
+}
+
+/*set the memory shared by all open images*/
+void MyFrame::OnBudget(wxCommandEvent& event){
+    long megabytes = wxGetNumberFromUser("Memoria para imagenes, historiales y vistas de todas las pestañas",
+                                            "MB:","Memoria",memoryBudget >> 20,16,1 << 20,this);
+    if(megabytes <= 0)
+        return;
+    memoryBudget = (size_t)megabytes << 20;
+    enforceBudget();
+
+    wxString logMessage = wxString::Format(wxT("Presupuesto de memoria: %ld MB"),megabytes);
+    setTextInLog(logMessage);
+}
+
+/*journal the pixels written back by undo/redo, a selection journals its spans and selected pixels only.
+  They count towards the next checkpoint like applied operations, so undo/redo loops do not grow the journal*/
+void MyFrame::journalPatch(int type, ImageProcess &img_op, int patch_mode){
+    if(!img_op.isMasked()){
+        doc->journal.logPatch(type,img_op.getX(),img_op.getY(),img_op.getWidth(),img_op.getHeight(),
+                                img_op.getPatchData(patch_mode));
+    }else{
+        int maskType = type == sessionJournal::REC_UNDO ? sessionJournal::REC_MASKUNDO : sessionJournal::REC_MASKREDO;
+        doc->journal.logMaskPatch(maskType,*img_op.getMask(),img_op.getPatchData(patch_mode));
+    }
+    if(++doc->opsSinceCheckpoint >= CHECKPOINTSTEP)
+        checkpointSession(doc);
+}
+
+/*keep a selection for the next operations of a document, an empty one goes back to the square*/
+void MyFrame::setSelection(imageDocument *document, const spanMask &mask){
+    if(mask.isEmpty()){
+        document->selection.reset();
+        document->panel->clearOutline();
+        setTextInLog(wxT("Seleccion vacia, se operara el rectangulo de los controles"));
+        return;
+    }
+    document->selection = std::make_shared<const spanMask>(mask);
+
+    wxString logMessage = wxString::Format(wxT("Seleccion de %zu pixeles en %zu tramos (x:%d, y:%d, base:%d, altura:%d)"),
+                                            mask.area(),mask.getSpans().size(),mask.getLeft(),mask.getTop(),
+                                            mask.getWidth(),mask.getHeight());
+    setTextInLog(logMessage);
+}
+
+/*the next drag over the image draws the selection*/
+void MyFrame::OnLasso(wxCommandEvent& event){
+    doc->panel->startLasso();
+    setTextInLog(wxT("Dibuje el lazo sobre la imagen manteniendo el boton izquierdo"));
+}
+
+/*select the pixels of the square with gray value inside a range*/
+void MyFrame::OnThreshold(wxCommandEvent& event){
+    if(doc->loading){
+        wxMessageBox("La imagen aun se esta cargando, espere a que termine para seleccionar","Imagen cargando", wxOK);
+        return;
+    }
+    long low = wxGetNumberFromUser("Valor minimo de los pixeles seleccionados","Minimo:","Umbral",0,0,255,this);
+    if(low < 0)
+        return;
+    long high = wxGetNumberFromUser("Valor maximo de los pixeles seleccionados","Maximo:","Umbral",255,0,255,this);
+    if(high < 0)
+        return;
+
+    int square[4];
+    getSquare(square);
+    wxImage image = doc->panel->getImage();
+    doc->panel->clearOutline();
+    setSelection(doc,spanMask::threshold(viewOf(image),square[0],square[1],square[2],square[3],
+                                            std::min(low,high),std::max(low,high)));
+}
+
+/*operate the square of the spin controls again*/
+void MyFrame::OnSelectSquare(wxCommandEvent& event){
+    doc->selection.reset();
+    doc->panel->clearOutline();
+    setTextInLog(wxT("Se operara el rectangulo de los controles"));
 }
 
 /*Write message in log panel including current event time*/
@@ -719,8 +1790,24 @@ void MyFrame::setTextInLog(wxString logMessage){
 void MyFrame::resetFrame(){
 
     //set default values on spin controls
-    alpha->SetValue(1.0);
-    beta->SetValue(0);
+    setParamControls(filterList->GetSelection());
+    updateLimits();
+
+    //clear stacks
+    doc->undoStack.clearStack();
+    undoBtn->Disable();
+    doc->redoStack.clearStack();
+    redoBtn->Disable();
+
+    //selections belong to the previous image
+    doc->selection.reset();
+    doc->panel->clearOutline();
+}
+
+/*take the size of the displayed image as limit of the square spin controls*/
+void MyFrame::updateLimits(){
+    XYLimit[0] = doc->panel->getWidth();
+    XYLimit[1] = doc->panel->getHeight();
     xUpperLeft->SetRange(0,XYLimit[0]-1);
     xUpperLeft->SetValue(0);
     yUpperLeft->SetRange(0,XYLimit[1]-1);
@@ -729,21 +1816,33 @@ void MyFrame::resetFrame(){
     width->SetValue(0);
     height->SetRange(0,XYLimit[1]-1);
     height->SetValue(0);
+}
 
-    //clear stacks
-    undoStack.clearStack();
-    undoBtn->Disable();
-    redoStack.clearStack();
-    redoBtn->Disable();
-
-    //clear log textbox
-    textlog->Clear();
+/*write the filtered (1) or pre-filtered (0) patch of an operation over the displayed image,
+  a resize replaces the image with a new one of the patch size*/
+void MyFrame::showPatch(ImageProcess &img_op, int patch_mode){
+    wxImage image = doc->panel->getImage();
+    int patchW = patch_mode ? img_op.getResultWidth() : img_op.getWidth();
+    int patchH = patch_mode ? img_op.getResultHeight() : img_op.getHeight();
+    bool sizeChanged = img_op.getOpID() == OP_RESIZE && (patchW != XYLimit[0] || patchH != XYLimit[1]);
+    if(sizeChanged)
+        image = wxImage(patchW,patchH,false);
+
+    img_op.setPatchImage(viewOf(image),patch_mode);
+    doc->panel->setImage(image);
+    if(sizeChanged){
+        updateLimits();
+        doc->selection.reset();
+        doc->panel->clearOutline();
+    }
+    if(!replaying)
+        doc->panel->Refresh();
 }
 
 /*Enable or disable Undo-Redo buttons checking their respective stack*/
 void MyFrame::updateUndoRedo(int type){
     //check if there are operations to undo
-    int stackElements = undoStack.getElements();
+    int stackElements = doc->undoStack.getElements();
     if(stackElements == 0){
         undoBtn->Disable();
     }else{
@@ -756,11 +1855,11 @@ void MyFrame::updateUndoRedo(int type){
 
     //if operation type is a new operation, clear redo stack
     if(type)
-        redoStack.clearStack();
+        doc->redoStack.clearStack();
     
     //check if there are operations to redo
-    stackElements = redoStack.getElements();
-    if(redoStack.getElements() == 0){
+    stackElements = doc->redoStack.getElements();
+    if(doc->redoStack.getElements() == 0){
         redoBtn->Disable();
     }else{
         redoBtn->Enable();
@@ -783,25 +1882,46 @@ void MyFrame::OnAbout(wxCommandEvent& event){
                  "About", wxOK | wxICON_INFORMATION);
 }
  
-/*Open file dialog to select files in pgm format*/
+/*Open file dialog to select files in pgm format or saved projects*/
 void MyFrame::OnOpen(wxCommandEvent& event){
     wxFileDialog fileDialog(this, _("Seleccione imagen PGM"), 
                             wxEmptyString, wxEmptyString, 
-                            _("PGM files (*.pgm)|*.pgm|All files (*.)|*.*"),
+                            _("PGM files (*.pgm)|*.pgm|Proyecto (*.pyap)|*.pyap|All files (*.)|*.*"),
                              wxFD_OPEN|wxFD_FILE_MUST_EXIST);
     
 
     if (fileDialog.ShowModal()==wxID_OK){
-        //set image
         wxString path = fileDialog.GetPath();
-        drawPanel->setImage(path,wxBITMAP_TYPE_PNM);
-        drawPanel->Refresh();
+        if(documents.size() >= MAXDOCUMENTS){
+            wxMessageBox("Hay demasiadas imagenes abiertas, cierre alguna antes de abrir otra","Error", wxOK);
+            return;
+        }
+        if(path.Lower().EndsWith(".pyap")){
+            openProject(path);
+            return;
+        }
+
+        //read the header only, rows are decoded in the background and shown as they arrive
+        imageDocument *document = newDocument(wxFileName(path).GetFullName());
+        if(!document->loader.start(path.fn_str())){
+            closeDocument(document);
+            wxMessageBox("Hubo un problema al cargar la imagen, revise el formato","Error", wxOK);
+            return;
+        }
+        document->panel->setImage(wxImage(document->loader.width,document->loader.height,true));
+        document->panel->Refresh();
 
-        //get image size
-        XYLimit[0] = drawPanel->getWidth();
-        XYLimit[1] = drawPanel->getHeight();
+        //limits of the new image size
         resetFrame();
-        wxString logMessage = wxString::Format(wxT("Imagen cargada (w:%d,h:%d) ruta:%s"),XYLimit[0],XYLimit[1],path);
+        document->journal.open(journalPath(document->slot).fn_str(),false);
+        document->sourcePath = path;
+        document->loading = true;
+        document->previewShown = false;
+        document->rowsShown = 0;
+        if(!loadTimer.IsRunning())
+            loadTimer.Start(LOADTICKMS);
+
+        wxString logMessage = wxString::Format(wxT("Cargando imagen (w:%d,h:%d) ruta:%s"),XYLimit[0],XYLimit[1],path);
         setTextInLog(logMessage);
         
     }else{
@@ -810,19 +1930,124 @@ void MyFrame::OnOpen(wxCommandEvent& event){
     
 }
 
-/*Save file dialog to save new image in pgm format*/
+/*cancel the image being decoded in a document, if any*/
+void MyFrame::stopLoading(imageDocument *document){
+    document->loader.stop();
+    document->loading = false;
+}
+
+/*copy rows of every document decoded since the last tick, the timer stops once no image is loading*/
+void MyFrame::OnLoadTimer(wxTimerEvent& event){
+    bool pending = false;
+    for(size_t i = 0; i < documents.size(); i++){
+        if(!documents[i]->loading)
+            continue;
+        showLoadedRows(documents[i]);
+        pending = pending || documents[i]->loading;
+    }
+    if(!pending)
+        loadTimer.Stop();
+}
+
+/*copy decoded rows to the image of a document, the loaded image becomes the original once complete*/
+void MyFrame::showLoadedRows(imageDocument *document){
+    wxImage image = document->panel->getImage();
+    int w = document->loader.width;
+    int h = document->loader.height;
+
+    //rows not decoded yet repeat the nearest sampled row above them
+    bool previewFilled = document->loader.previewReady && !document->previewShown;
+    if(previewFilled){
+        for(int y = document->rowsShown; y < h; y++)
+            setGrayRect(image,0,y,w,1,document->loader.preview.data() + (size_t)(y/document->loader.previewStep)*w);
+        document->previewShown = true;
+    }
+    int rows = document->loader.rowsDone;
+    if(rows > document->rowsShown){
+        setGrayRect(image,0,document->rowsShown,w,rows-document->rowsShown,
+                    document->loader.gray.data() + (size_t)document->rowsShown*w);
+        //pixels are written in place, the display only scales the new rows again
+        if(!previewFilled)
+            document->panel->updateRows(document->rowsShown,rows);
+        document->rowsShown = rows;
+    }
+    if(previewFilled)
+        document->panel->setImage(image);
+    if(document == doc)
+        document->panel->Refresh();
+
+    if(!document->loader.finished())
+        return;
+    document->loading = false;
+    if(document->loader.failed)
+        wxMessageBox("Hubo un problema al cargar la imagen, revise el formato","Error", wxOK);
+
+    //keep loaded pixels as the original image of the project, operations applied while loading are in the checkpoint
+    document->originalImage = document->loader.gray;
+    checkpointSession(document);
+    enforceBudget();
+
+    wxString logMessage = wxString::Format(wxT("Imagen cargada (w:%d,h:%d) ruta:%s, filas leidas:%d"),
+                                            w,h,document->sourcePath,document->rowsShown);
+    setTextInLog(logMessage);
+}
+
+/*open a project in a new page restoring image and history*/
+void MyFrame::openProject(wxString path){
+    wxImage image;
+    patchBuffer original;
+    wxString source;
+    std::vector<ImageProcess> undoItems, redoItems;
+    if(!projectFile::open(path.fn_str(),image,original,source,undoItems,redoItems)){
+        wxMessageBox("Hubo un problema al cargar el proyecto, revise el formato","Error", wxOK);
+        return;
+    }
+
+    imageDocument *document = newDocument(wxFileName(path).GetFullName());
+    document->panel->setImage(image);
+    document->panel->Refresh();
+    resetFrame();
+    document->journal.open(journalPath(document->slot).fn_str(),false);
+    checkpointSession(document);
+    document->originalImage = original;
+    document->sourcePath = source;
+
+    //history patches are only read from the file when they are undone or redone
+    for(size_t i = 0; i < undoItems.size(); i++)
+        document->undoStack.push(undoItems[i]);
+    for(size_t i = 0; i < redoItems.size(); i++)
+        document->redoStack.push(redoItems[i]);
+    updateUndoRedo(0);
+    enforceBudget();
+
+    wxString logMessage = wxString::Format(wxT("Proyecto cargado (w:%d,h:%d) ruta:%s, imagen original:%s"),
+                                            XYLimit[0],XYLimit[1],path,source);
+    setTextInLog(logMessage);
+}
+
+/*Save file dialog to save new image in pgm format or the whole session as a project*/
 void MyFrame::OnSave(wxCommandEvent& event){
     wxFileDialog fileDialog(this, _("Guardar imagen PGM"), 
                             wxEmptyString, wxEmptyString, 
-                            _("PGM file|*.pgm|All files|*.*"), 
+                            _("PGM file|*.pgm|Proyecto|*.pyap|All files|*.*"), 
                             wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
 
     if (fileDialog.ShowModal() == wxID_CANCEL)
         return;     //fileDialog canceled
+    if(doc->loading){
+        wxMessageBox("La imagen aun se esta cargando, espere a que termine para guardarla","Imagen cargando", wxOK);
+        return;
+    }
 
-    if (fileDialog.ShowModal()==wxID_OK){
-        wxString path = fileDialog.GetPath();
-        drawPanel->getImage().SaveFile(path,wxBITMAP_TYPE_PNM);
+    wxString path = fileDialog.GetPath();
+    wxImage image = doc->panel->getImage();
+    bool saved;
+    if(path.Lower().EndsWith(".pyap"))
+        saved = projectFile::save(path.fn_str(),image,doc->originalImage,doc->sourcePath,doc->undoStack,doc->redoStack);
+    else
+        saved = image.SaveFile(path,wxBITMAP_TYPE_PNM);
+
+    if(saved){
         wxString logMessage = wxString::Format(wxT("Imagen guardada ruta:%s"),path);
         setTextInLog(logMessage);
     }else{
@@ -832,46 +2057,68 @@ void MyFrame::OnSave(wxCommandEvent& event){
 
 /*Undo button click*/
 void MyFrame::OnButtonUndoClick(wxCommandEvent& event){
+    undoOperation();
+}
+
+/*restore the pre-operated patch of the last operation*/
+void MyFrame::undoOperation(){
 
     //get last operation from the stack
-    ImageProcess img_op = undoStack.pop();
+    ImageProcess img_op = doc->undoStack.pop();
     //set pre-operated patch over the whole image (parameter 0 to take original patch)
-    wxImage image = drawPanel->getImage();
-    drawPanel->setImage(img_op.setPatchImage(image,0),wxBITMAP_TYPE_PNM);
-    drawPanel->Refresh();
+    showPatch(img_op,0);
+
+    //journal restored pixels (a new size is journaled as a checkpoint, the end of a load checkpoints anyway)
+    if(!doc->loading){
+        if(img_op.getOpID() == OP_RESIZE)
+            checkpointSession(doc);
+        else
+            journalPatch(sessionJournal::REC_UNDO,img_op,0);
+    }
 
     //add operation to the redostack
-    redoStack.push(img_op);
+    doc->redoStack.push(img_op);
     updateUndoRedo(0);
 
     //show result in log 
     wxString logMessage = wxString::Format(wxT("Operacion (%s) deshecha sobre x:%d, y:%d, base:%d, altura:%d"),
-                                            filterList->GetString(img_op.getOpID()),img_op.getX(),img_op.getY(),
+                                            operationName(img_op.getOpID()),img_op.getX(),img_op.getY(),
                                             img_op.getWidth(),img_op.getHeight());
     setTextInLog(logMessage);
 
     //print stack state on log textbox
-    logMessage = wxString::Format(wxT("Operaciones en pila a recuperar: %d/10"),redoStack.getElements());
+    logMessage = wxString::Format(wxT("Operaciones en pila a recuperar: %d/10"),doc->redoStack.getElements());
     setTextInLog(logMessage);
     
 }
 
 /*Redo button click*/
 void MyFrame::OnButtonRedoClick(wxCommandEvent& event){
+    redoOperation();
+}
+
+/*set again the operated patch of the last undone operation*/
+void MyFrame::redoOperation(){
     //get last operation from the stack
-    ImageProcess img_op = redoStack.pop();
+    ImageProcess img_op = doc->redoStack.pop();
     //set pre-operated patch over the whole image (parameter 1 to take operated patch)
-    wxImage image = drawPanel->getImage();
-    drawPanel->setImage(img_op.setPatchImage(image,1),wxBITMAP_TYPE_PNM);
-    drawPanel->Refresh();
+    showPatch(img_op,1);
+
+    //journal restored pixels (a new size is journaled as a checkpoint, the end of a load checkpoints anyway)
+    if(!doc->loading){
+        if(img_op.getOpID() == OP_RESIZE)
+            checkpointSession(doc);
+        else
+            journalPatch(sessionJournal::REC_REDO,img_op,1);
+    }
 
     //add operation to the undostack
-    undoStack.push(img_op);
+    doc->undoStack.push(img_op);
     updateUndoRedo(0);
 
     //show result in log 
     wxString logMessage = wxString::Format(wxT("Operacion (%s) recuperada sobre x:%d, y:%d, base:%d, altura:%d"),
-                                            filterList->GetString(img_op.getOpID()),img_op.getX(),img_op.getY(),
+                                            operationName(img_op.getOpID()),img_op.getX(),img_op.getY(),
                                             img_op.getWidth(),img_op.getHeight());
     setTextInLog(logMessage);
 }
@@ -881,18 +2128,33 @@ void MyFrame::OnListBoxSelection(wxCommandEvent& event){
     //enable Apply button
     apply->Enable();
 
-    //check if "Contraste" option was selected
-    if(event.IsSelection() & filterList->IsSelected(3)){
-        //enable alpha-beta spincontrols
-        alpha->Enable();
-        beta->Enable();
-    }else if (event.IsSelection() & alpha->IsEnabled()){
-        alpha->Disable();
-        beta->Disable();
-    }
+    //show parameters of the selected operation
+    if(event.IsSelection())
+        setParamControls(filterList->GetSelection());
     
 }
 
+/*set labels, ranges and state of parameter controls for an item of the operations list*/
+void MyFrame::setParamControls(int item){
+    wxSpinCtrlDouble *controls[2] = {param1,param2};
+    wxStaticText *labels[2] = {param1Label,param2Label};
+
+    for(int i = 0; i < 2; i++){
+        if(item < 0 || item >= OPERATIONS || i >= operationList[item].params){
+            labels[i]->SetLabel("");
+            controls[i]->Disable();
+            continue;
+        }
+
+        const operationInfo &info = operationList[item];
+        labels[i]->SetLabel(info.paramLabel[i]);
+        controls[i]->SetRange(info.minValue[i],info.maxValue[i]);
+        controls[i]->SetIncrement(info.step[i]);
+        controls[i]->SetValue(info.initial[i]);
+        controls[i]->Enable();
+    }
+}
+
 /*Changes made on X upper left spin controls to limit square selection*/
 void MyFrame::OnXULSpinChange(wxCommandEvent& event){
     //set x values for the lower Right higher or equal to this x value
@@ -910,36 +2172,106 @@ void MyFrame::OnYULSpinChange(wxCommandEvent& event){
 void MyFrame::OnButtonApplyClick(wxCommandEvent& event){
 
     //get operation selected from the list
-    int operation = filterList->GetSelection();
+    int operation = operationList[filterList->GetSelection()].op_ID;
 
     //create operating patch with the selected square over the whole image
-    int square[] = {xUpperLeft->GetValue(),yUpperLeft->GetValue(),width->GetValue(),height->GetValue()};
-    wxImage image = drawPanel->getImage();
-    ImageProcess img_op;
+    int square[4];
+    getSquare(square);
+
+    //a lasso or threshold selection replaces the square (resize always takes the whole image)
+    std::shared_ptr<const spanMask> selection = operation == OP_RESIZE ? nullptr : doc->selection;
+    if(selection){
+        square[0] = selection->getLeft();
+        square[1] = selection->getTop();
+        square[2] = selection->getWidth();
+        square[3] = selection->getHeight();
+    }else if(operation != OP_RESIZE && (square[2] <= 0 || square[3] <= 0)){
+        wxMessageBox("El area a operar esta vacia, indique base y altura","Area vacia", wxOK);
+        return;
+    }
+
+    //while the image loads only rows already decoded can be operated, a selection also reads its halo
+    int rowsNeeded = operation == OP_RESIZE ? XYLimit[1] : square[1] + square[3];
+    if(selection){
+        double params[2] = {param1->GetValue(), param2->GetValue()};
+        int halo = ImageProcess::haloSize(operation,params);
+        rowsNeeded = std::min(XYLimit[1], rowsNeeded + std::max(halo, 0));
+    }
+    if(doc->loading && rowsNeeded > doc->rowsShown){
+        wxString message = wxString::Format(wxT("La imagen aun se esta cargando, solo se pueden operar las primeras %d filas"),
+                                            doc->rowsShown);
+        wxMessageBox(message,"Imagen cargando", wxOK);
+        return;
+    }
+
+    applyOperation(operation,square,param1->GetValue(),param2->GetValue(),selection);
+}
 
+/*square of the spin controls, the whole image when no size was given*/
+void MyFrame::getSquare(int *square){
+    square[0] = xUpperLeft->GetValue();
+    square[1] = yUpperLeft->GetValue();
+    square[2] = width->GetValue();
+    square[3] = height->GetValue();
     if(square[2] == 0 & square[3] == 0){
         //operate over the whole image if both coordinates point to the same pixel
+        square[0] = square[1] = 0;
         square[2] = XYLimit[0];
         square[3] = XYLimit[1];
-        img_op = ImageProcess(image,operation,0,0,XYLimit[0],XYLimit[1]);
-    }else{
-        img_op = ImageProcess(image,operation,square[0],square[1],square[2],square[3]);
     }
+}
+
+/*apply an operation over a square or a selection of the image and record it (also used on session replay)*/
+void MyFrame::applyOperation(int operation, int *square, double param1Value, double param2Value,
+                                std::shared_ptr<const spanMask> selection){
+    if(operation < 0 || operation >= OP_COUNT)
+        return;
+    wxImage image = doc->panel->getImage();
+    ImageProcess img_op = selection && operation != OP_RESIZE ?
+                            ImageProcess(viewOf(image),operation,selection,param1Value,param2Value) :
+                            ImageProcess(viewOf(image),operation,square[0],square[1],square[2],square[3],
+                                        param1Value,param2Value);
     
-    //apply operation based on user's selection
-    if(operation < 3)
-        drawPanel->setImage((img_op.*opArr[filterList->GetSelection()])(image),wxBITMAP_TYPE_PNM);
-    else
-        drawPanel->setImage(img_op.constrast(image,alpha->GetValue(),beta->GetValue()),wxBITMAP_TYPE_PNM);
-    drawPanel->Refresh();
+    //apply operation based on user's selection (halos of a selection are read from the image)
+    img_op.process(viewOf(image));
+    showPatch(img_op,1);
 
     //add operation to the stack
-    undoStack.push(img_op);
+    doc->undoStack.push(img_op);
     updateUndoRedo(1);
 
+    //journal operation, taking a new checkpoint once enough operations were recorded
+    //(while doc->loading, the checkpoint at the end of the load records them)
+    if(!replaying && !doc->loading){
+        doc->journal.logApply(operation,square,param1Value,param2Value,img_op.getMask().get());
+        if(++doc->opsSinceCheckpoint >= CHECKPOINTSTEP)
+            checkpointSession(doc);
+    }
+    enforceBudget();
+
     //show result in log 
     wxString logMessage = wxString::Format(wxT("Operacion (%s) aplicada sobre x:%d, y:%d, base:%d, altura:%d"),
-                                    filterList->GetString(operation),square[0],square[1],square[2],square[3]);
+                                    operationName(operation),img_op.getX(),img_op.getY(),
+                                    img_op.getWidth(),img_op.getHeight());
+    setTextInLog(logMessage);
+    if(img_op.isMasked()){
+        logMessage = wxString::Format(wxT("Pixeles seleccionados operados: %zu"),img_op.getPatchSize(1));
+        setTextInLog(logMessage);
+    }
+    if(operation == OP_RESIZE){
+        logMessage = wxString::Format(wxT("Nuevo tamano de imagen (w:%d,h:%d)"),XYLimit[0],XYLimit[1]);
+        setTextInLog(logMessage);
+    }
+
+    //show buffer pool counters
+    logMessage = wxString::Format(wxT("Memoria de parches: %ld solicitudes, %ld reutilizadas, %ld reservas, %zu KB en uso, %zu KB libres"),
+                                    patchPool.requests,patchPool.reused,patchPool.allocations,
+                                    patchPool.bytesInUse/1024,patchPool.bytesCached/1024);
+    setTextInLog(logMessage);
+
+    //show result cache counters
+    logMessage = wxString::Format(wxT("Cache de resultados: %ld aciertos, %ld fallos, %zu resultados, %zu KB"),
+                                    results.hits,results.misses,results.entries(),results.bytes/1024);
     setTextInLog(logMessage);
 }
 